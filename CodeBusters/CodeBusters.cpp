@@ -5,13 +5,14 @@
 #include <utility>
 #include <cassert>
 #include <cmath>
+#include <limits>
 #include <cstdlib>
-#include <map>
-#include <set>
+#include <bitset>
 
 using namespace std;
 
 static const int TEAMS_COUNT = 2;
+static const int MAX_BUSTERS_PER_PLAYER = 5;
 static const int FOG_OF_WAR_RADIUS = 2200;
 static const int MOVE_DISTANCE = 800;
 static const int GHOST_RUN_AWAY_DISTANCE = 400;
@@ -100,13 +101,21 @@ struct Vector
     float m_Y;
 };
 
-int Distance(const Point& first, const Point& second)
+int DistanceSquared(const Point& first, const Point& second)
 {
-    int dist2 = sqr(first.m_X - second.m_X) + sqr(first.m_Y - second.m_Y);
+    return sqr(first.m_X - second.m_X) + sqr(first.m_Y - second.m_Y);
+}
 
+int DistanceFromSquared(int dist2)
+{
     return (int)ceil(sqrt((float)dist2));
 }
 
+int Distance(const Point& first, const Point& second)
+{
+    return DistanceFromSquared(DistanceSquared(first, second));
+}
+
 class Base
 {
 public:
@@ -249,6 +258,132 @@ Point Map::GetRandomDestination(int round, const Point& prevDestination) const
     return tempGrid[rand() % min(min((int)NUM_X, (int)NUM_Y), 10)].m_Position;
 }
 
+// Uniform grid of entities over map, rebuilt every round. Distances are compared squared.
+template <class T>
+class SpatialGrid
+{
+public:
+    static const int CELL_SIZE = 2000;
+    static const int NUM_X = MAP_RIGHT / CELL_SIZE + 1;
+    static const int NUM_Y = MAP_BOTTOM / CELL_SIZE + 1;
+
+    // Rebuilding grid does not allocate after this.
+    void Reserve(int count)
+    {
+        for (auto& cell : m_Cells)
+            cell.reserve(count);
+    }
+
+    void Clear()
+    {
+        for (auto& cell : m_Cells)
+            cell.clear();
+    }
+
+    void Insert(T& entity)
+    {
+        const Point& position = entity.GetPosition();
+        m_Cells[GetCellX(position) + GetCellY(position) * NUM_X].push_back(&entity);
+    }
+
+    // Calls func(entity, dist2) for entities within radius.
+    template <class FUNC>
+    void ForEachInRadius(const Point& position, int radius, FUNC func) const
+    {
+        const int minX = GetCellX(position - Point(radius, radius));
+        const int maxX = GetCellX(position + Point(radius, radius));
+        const int minY = GetCellY(position - Point(radius, radius));
+        const int maxY = GetCellY(position + Point(radius, radius));
+        const int radius2 = sqr(radius);
+
+        for (int y = minY; y <= maxY; ++y)
+        {
+            for (int x = minX; x <= maxX; ++x)
+            {
+                for (T* entity : m_Cells[x + y * NUM_X])
+                {
+                    int dist2 = DistanceSquared(position, entity->GetPosition());
+                    if (dist2 <= radius2)
+                        func(*entity, dist2);
+                }
+            }
+        }
+    }
+
+    // Up to K nearest entities accepted by filter, nearest first. Returns their number.
+    template <size_t K, class FILTER>
+    size_t FindNearest(const Point& position, FILTER filter, T* (&nearest)[K]) const
+    {
+        int nearestDist2[K];
+        size_t count = 0;
+
+        VisitRings(position, [&](T& entity, int dist2)
+        {
+            if ((count == K && dist2 >= nearestDist2[K - 1]) || !filter(entity))
+                return;
+
+            size_t idx = count < K ? count++ : K - 1;
+            for (; idx > 0 && nearestDist2[idx - 1] > dist2; --idx)
+            {
+                nearest[idx] = nearest[idx - 1];
+                nearestDist2[idx] = nearestDist2[idx - 1];
+            }
+            nearest[idx] = &entity;
+            nearestDist2[idx] = dist2;
+        },
+        [&](int ringDist)
+        {
+            return count == K && sqr(ringDist) >= nearestDist2[K - 1];
+        });
+
+        return count;
+    }
+
+    template <class FILTER>
+    T* FindNearest(const Point& position, FILTER filter) const
+    {
+        T* nearest[1] = { nullptr };
+        return FindNearest(position, filter, nearest) ? nearest[0] : nullptr;
+    }
+
+private:
+    static int GetCellX(const Point& position) { return min(max(position.m_X / CELL_SIZE, 0), NUM_X - 1); }
+    static int GetCellY(const Point& position) { return min(max(position.m_Y / CELL_SIZE, 0), NUM_Y - 1); }
+
+    // Visits cells in rings around position until stop(ringDist), entities of further rings are farther than ringDist.
+    template <class VISIT, class STOP>
+    void VisitRings(const Point& position, VISIT visit, STOP stop) const
+    {
+        const int cellX = GetCellX(position);
+        const int cellY = GetCellY(position);
+        const int maxRing = max(max(cellX, NUM_X - 1 - cellX), max(cellY, NUM_Y - 1 - cellY));
+
+        for (int ring = 0; ring <= maxRing; ++ring)
+        {
+            for (int y = max(cellY - ring, 0); y <= min(cellY + ring, NUM_Y - 1); ++y)
+            {
+                // Inner rows of ring have only its left and right cell.
+                const bool edgeRow = y == cellY - ring || y == cellY + ring;
+                const int stepX = edgeRow ? 1 : 2 * ring;
+
+                for (int x = cellX - ring; x <= cellX + ring; x += stepX)
+                {
+                    if (x < 0 || x >= NUM_X)
+                        continue;
+
+                    for (T* entity : m_Cells[x + y * NUM_X])
+                        visit(*entity, DistanceSquared(position, entity->GetPosition()));
+                }
+            }
+
+            if (stop(ring * CELL_SIZE))
+                return;
+        }
+    }
+
+    vector<T*> m_Cells[NUM_X * NUM_Y];
+};
+
 class Entity
 {
 public:
@@ -258,6 +393,8 @@ public:
 
     void SetId(int id) { m_Id = id; }
     int GetId() const { return m_Id; }
+    // Entities are stored by id from start of game, id is set when entity is seen first time.
+    bool IsKnown() const { return m_Id >= 0; }
 
     void SetLastSeenRound(int round) { m_LastSeenRound = round; }
     int GetLastSeenRound() const { return m_LastSeenRound; }
@@ -288,7 +425,7 @@ public:
 
         m_CarriedBy = -1;
         m_NumBusting = 0;
-        m_BustingBy.clear();
+        m_BustingBy.reset();
     }
     void SetBusting(int round, const Point& position, int stamina, int numBusting)
     {
@@ -299,7 +436,7 @@ public:
 
         m_CarriedBy = -1;
         m_NumBusting = numBusting;
-        m_BustingBy.clear();
+        m_BustingBy.reset();
     }
     void SetBusted()
     {
@@ -329,7 +466,7 @@ public:
 
         m_CarriedBy = entityId;
         m_NumBusting = 0;
-        m_BustingBy.clear();
+        m_BustingBy.reset();
     }
 
     void SetBustingBy(int round, int entityId, const Point& entityPos)
@@ -339,7 +476,7 @@ public:
         {
             m_CarriedBy = -1;
             m_NumBusting = 0;
-            m_BustingBy.clear();
+            m_BustingBy.reset();
         }
 
         if (m_LastSeenRound != round)
@@ -352,8 +489,10 @@ public:
         else
             cerr << __FUNCTION__ << " assert(m_NumBusting > 0)" << endl;
 
-        m_BustingBy.insert(entityId);
-        cerr << __FUNCTION__ << " assert((int)m_BustingBy.size() <= m_NumBusting)" << endl;
+        // Ids beyond bitset are only counted in m_NumBusting.
+        if (entityId >= 0 && entityId < (int)m_BustingBy.size())
+            m_BustingBy.set(entityId);
+        cerr << __FUNCTION__ << " assert((int)m_BustingBy.count() <= m_NumBusting)" << endl;
 
         if (m_LastSeenRound != round)
         {
@@ -378,7 +517,8 @@ private:
     int m_LastSeenByOthersRound = -1;
     int m_CarriedBy = -1;
     int m_NumBusting = 0;
-    set<int> m_BustingBy;
+    // Ids of busters, which are below TEAMS_COUNT * MAX_BUSTERS_PER_PLAYER.
+    bitset<TEAMS_COUNT * MAX_BUSTERS_PER_PLAYER> m_BustingBy;
 };
 
 class Buster : public Entity
@@ -513,10 +653,6 @@ private:
     int m_EnemyId = -1;
 };
 
-Ghost* FindNearestGhost(const Point& position, map<int, Ghost>& ghosts);
-Ghost* FindNearestGhostWithState(const Point& position, Ghost::EState state, map<int, Ghost>& ghosts);
-Buster* FindNearestNotStunnedEnemy(const Point& position, vector<Buster>& enemies);
-
 class World
 {
 public:
@@ -556,15 +692,31 @@ private:
         in >> m_PlayerTeamId; in.ignore();
 
         cerr << __FUNCTION__ << " assert(m_PlayerTeamId >= 0 && m_PlayerTeamId < TEAMS_COUNT)" << endl;
+        cerr << __FUNCTION__ << " assert(m_BustersPerPlayer <= MAX_BUSTERS_PER_PLAYER)" << endl;
     }
 
+    // All storage of game is allocated here, updates of rounds do not allocate.
     void CreateEntities()
     {
-        m_PlayersVector.resize(m_BustersPerPlayer);
-        m_EnemiesVector.resize(m_BustersPerPlayer);
+        m_Players.resize(m_BustersPerPlayer);
+        m_Enemies.resize(m_BustersPerPlayer);
+        m_Ghosts.resize(m_GhostCount);
+
+        m_PlayersGrid.Reserve(m_BustersPerPlayer);
+        m_EnemiesGrid.Reserve(m_BustersPerPlayer);
+        m_GhostsGrid.Reserve(m_GhostCount);
+    }
+
+    // Index of buster in storage of its team, ids of team go from teamId * m_BustersPerPlayer. -1 for id out of team.
+    int GetBusterIdx(int busterId, int teamId) const
+    {
+        const int idx = busterId - teamId * m_BustersPerPlayer;
+        return idx >= 0 && idx < m_BustersPerPlayer ? idx : -1;
     }
+    bool IsGhostId(int ghostId) const { return ghostId >= 0 && ghostId < m_GhostCount; }
 
     void UpdateWorldStateAfterPrevRound(istream& in, ostream& log);
+    void UpdateSpatialGrids();
     void SimulateNextMove(ostream& out, ostream& log);
 
 
@@ -580,12 +732,15 @@ private:
     Base m_Bases[TEAMS_COUNT] = { Base(0), Base(1) };
     Map m_Map;
 
-    map<int, Player> m_Players;
-    map<int, Buster> m_Enemies;
-    map<int, Ghost> m_Ghosts;
+    // Entities by id, busters by index in team.
+    vector<Player> m_Players;
+    vector<Buster> m_Enemies;
+    vector<Ghost> m_Ghosts;
 
-    vector<Player> m_PlayersVector;
-    vector<Buster> m_EnemiesVector;
+    // Entities by position, rebuilt after update of every round.
+    SpatialGrid<Player> m_PlayersGrid;
+    SpatialGrid<Buster> m_EnemiesGrid;
+    SpatialGrid<Ghost> m_GhostsGrid;
 
     int m_RoundNum = 0;
 };
@@ -608,59 +763,44 @@ void World::UpdateWorldStateAfterPrevRound(istream& in, ostream& log)
 
         if (entityType != -1)
         {
+            const int idx = GetBusterIdx(entityId, entityType);
+            if (idx < 0)
             {
-                int idx = entityId;
-                if (idx >= m_BustersPerPlayer)
-                    idx -= m_BustersPerPlayer;
-
-                auto& entity = entityType == GetPlayerTeamId() ? m_PlayersVector[idx] : m_EnemiesVector[idx];
-
-                entity.SetId(entityId);
-                entity.SetPosition(x, y);
-                switch (state)
-                {
-                default:
-                    //case 0:
-                    //case 3:
-                    entity.SetState(Buster::EState::Moving);
-                    break;
-                case 1:
-                    entity.SetState(Buster::EState::Carring);
-                    break;
-                case 2:
-                    entity.SetState(Buster::EState::Stunned);
-                    break;
-                }
-                entity.SetCarriedId(value);
+                cerr << __FUNCTION__ << " skipped buster " << entityId << " of team " << entityType << endl;
+                continue;
             }
 
-            {
-                auto& entity = entityType == GetPlayerTeamId() ? m_Players[entityId] : m_Enemies[entityId];
+            auto& entity = entityType == GetPlayerTeamId() ? m_Players[idx] : m_Enemies[idx];
 
-                entity.SetId(entityId);
+            entity.SetId(entityId);
 
-                switch (state)
-                {
-                case 0:
-                    entity.SetMoving(GetRound(), Point(x, y));
-                    break;
-                case 1:
-                    entity.SetCarring(GetRound(), Point(x, y), value);
-                    break;
-                case 2:
-                    entity.SetStunned(GetRound(), Point(x, y), value);
-                    break;
-                case 3:
-                    entity.SetBusting(GetRound(), Point(x, y), value);
-                    break;
-
-                default:
-                    cerr << __FUNCTION__ << " assert(false)" << endl;
-                }
+            switch (state)
+            {
+            case 0:
+                entity.SetMoving(GetRound(), Point(x, y));
+                break;
+            case 1:
+                entity.SetCarring(GetRound(), Point(x, y), value);
+                break;
+            case 2:
+                entity.SetStunned(GetRound(), Point(x, y), value);
+                break;
+            case 3:
+                entity.SetBusting(GetRound(), Point(x, y), value);
+                break;
+
+            default:
+                cerr << __FUNCTION__ << " assert(false)" << endl;
             }
         }
         else
         {
+            if (!IsGhostId(entityId))
+            {
+                cerr << __FUNCTION__ << " skipped ghost " << entityId << endl;
+                continue;
+            }
+
             auto& ghost = m_Ghosts[entityId];
             ghost.SetId(entityId);
 
@@ -673,8 +813,7 @@ void World::UpdateWorldStateAfterPrevRound(istream& in, ostream& log)
             {
                 int twinEntityId = entityId % 2 ? entityId + 1 : entityId - 1;
 
-                auto found = m_Ghosts.find(twinEntityId);
-                if (found == m_Ghosts.end())
+                if (IsGhostId(twinEntityId) && !m_Ghosts[twinEntityId].IsKnown())
                 {
                     auto& twinGhost = m_Ghosts[twinEntityId];
 
@@ -686,13 +825,19 @@ void World::UpdateWorldStateAfterPrevRound(istream& in, ostream& log)
     }
 
     // Update ghosts from busters.
-    for (const auto& player : m_Players)
+    for (const auto& buster : m_Players)
     {
-        const auto& buster = player.second;
+        if (!buster.IsKnown())
+            continue;
 
         if (buster.GetState() == Player::EState::Busting)
         {
             const int ghostId = buster.GetBustingId();
+            if (!IsGhostId(ghostId))
+            {
+                cerr << __FUNCTION__ << " skipped ghost " << ghostId << " of buster " << buster.GetId() << endl;
+                continue;
+            }
 
             auto& ghost = m_Ghosts[ghostId];
             ghost.SetId(ghostId);
@@ -702,6 +847,11 @@ void World::UpdateWorldStateAfterPrevRound(istream& in, ostream& log)
         else if (buster.GetState() == Player::EState::Carring)
         {
             const int ghostId = buster.GetBustingId();
+            if (!IsGhostId(ghostId))
+            {
+                cerr << __FUNCTION__ << " skipped ghost " << ghostId << " of buster " << buster.GetId() << endl;
+                continue;
+            }
 
             auto& ghost = m_Ghosts[ghostId];
             ghost.SetId(ghostId);
@@ -711,13 +861,19 @@ void World::UpdateWorldStateAfterPrevRound(istream& in, ostream& log)
 
     }
 
-    for (const auto& enemy : m_Enemies)
+    for (const auto& buster : m_Enemies)
     {
-        const auto& buster = enemy.second;
+        if (!buster.IsKnown())
+            continue;
 
         if (buster.GetState() == Player::EState::Busting)
         {
             const int ghostId = buster.GetBustingId();
+            if (!IsGhostId(ghostId))
+            {
+                cerr << __FUNCTION__ << " skipped ghost " << ghostId << " of buster " << buster.GetId() << endl;
+                continue;
+            }
 
             auto& ghost = m_Ghosts[ghostId];
             ghost.SetId(ghostId);
@@ -727,6 +883,11 @@ void World::UpdateWorldStateAfterPrevRound(istream& in, ostream& log)
         else if (buster.GetState() == Player::EState::Carring)
         {
             const int ghostId = buster.GetBustingId();
+            if (!IsGhostId(ghostId))
+            {
+                cerr << __FUNCTION__ << " skipped ghost " << ghostId << " of buster " << buster.GetId() << endl;
+                continue;
+            }
 
             auto& ghost = m_Ghosts[ghostId];
             ghost.SetId(ghostId);
@@ -738,61 +899,72 @@ void World::UpdateWorldStateAfterPrevRound(istream& in, ostream& log)
     // Find who stunned me.
     for (auto& player : m_Players)
     {
-        if (player.second.GetState() != Player::EState::Stunned)
+        if (!player.IsKnown())
+            continue;
+
+        if (player.GetState() != Player::EState::Stunned)
             continue;
-        if (player.second.GetStunnedRound() != GetRound())
+        if (player.GetStunnedRound() != GetRound())
             continue;
 
-        log << "Player " << player.second.GetId() << " just stunned";
+        log << "Player " << player.GetId() << " just stunned";
 
         //log << endl << "Round: " << GetRound() << endl;
 
-        vector<Buster*> enemies;
+        Buster* stunningEnemy = nullptr;
+        int stunningEnemiesCount = 0;
         for (auto& enemy : m_Enemies)
         {
-            //log << "ID:" << enemy.second.GetId() << " St:" << ('0' + (char)enemy.second.GetState()) << " ST:" << enemy.second.GetStunnedRound() << " SO:" << enemy.second.GetStunningOtherRound() << endl;
+            if (!enemy.IsKnown())
+                continue;
+
+            //log << "ID:" << enemy.GetId() << " St:" << ('0' + (char)enemy.GetState()) << " ST:" << enemy.GetStunnedRound() << " SO:" << enemy.GetStunningOtherRound() << endl;
 
-            if (enemy.second.GetState() == Buster::EState::Busting ||
-                enemy.second.GetState() == Buster::EState::Carring)
+            if (enemy.GetState() == Buster::EState::Busting ||
+                enemy.GetState() == Buster::EState::Carring)
                 continue;
 
-            if (enemy.second.GetState() == Buster::EState::Stunned &&
-                enemy.second.GetStunnedRound() != GetRound())
+            if (enemy.GetState() == Buster::EState::Stunned &&
+                enemy.GetStunnedRound() != GetRound())
                 continue;
 
-            if (!enemy.second.CanStunInRound(GetRound()))
+            if (!enemy.CanStunInRound(GetRound()))
                 continue;
 
-            if (Distance(player.second.GetPosition(), enemy.second.GetPosition()) > STUN_RADIUS)
+            if (Distance(player.GetPosition(), enemy.GetPosition()) > STUN_RADIUS)
                 continue;
 
-            enemies.push_back(&enemy.second);
+            stunningEnemy = &enemy;
+            ++stunningEnemiesCount;
         }
 
-        cerr << __FUNCTION__ << " assert(!enemies.empty())" << endl;
+        cerr << __FUNCTION__ << " assert(stunningEnemiesCount > 0)" << endl;
 
-        if (enemies.size() == 1)
+        if (stunningEnemiesCount == 1)
         {
-            enemies[0]->SetStunningOther(GetRound());
-            log << " by " << enemies[0]->GetId();
+            stunningEnemy->SetStunningOther(GetRound());
+            log << " by " << stunningEnemy->GetId();
         }
         else
-            log << " by multiple enemies " << enemies.size();
+            log << " by multiple enemies " << stunningEnemiesCount;
 
 
         log << endl;
     }
 
     // Check visited places.
-    for (const auto& player : m_Players)
+    for (const auto& buster : m_Players)
     {
-        const auto& buster = player.second;
+        if (!buster.IsKnown())
+            continue;
+
         m_Map.SetVisitedPlace(GetRound(), buster.GetPosition());
     }
 
-    for (auto& enemy : m_Enemies)
+    for (auto& buster : m_Enemies)
     {
-        auto& buster = enemy.second;
+        if (!buster.IsKnown())
+            continue;
 
         if (buster.GetLastSeenRound() != GetRound() &&
             buster.GetState() == Buster::EState::Carring)
@@ -820,8 +992,11 @@ void World::UpdateWorldStateAfterPrevRound(istream& in, ostream& log)
     // Check if Unknown position ghosts are still valid.
     for (auto& ghost : m_Ghosts)
     {
-        log << ghost.second.GetId() << ':';
-        switch (ghost.second.GetState())
+        if (!ghost.IsKnown())
+            continue;
+
+        log << ghost.GetId() << ':';
+        switch (ghost.GetState())
         {
         case Ghost::EState::Idle:
             log << 'I'; break;
@@ -835,13 +1010,13 @@ void World::UpdateWorldStateAfterPrevRound(istream& in, ostream& log)
 
         // TODO: Fix it. We don't know how to check if ghost is still in given position.
         /*
-        if (ghost.second.GetState() == Ghost::EState::UnknownPositon)
+        if (ghost.GetState() == Ghost::EState::UnknownPositon)
         {
             for (auto& player : m_Players)
             {
-                if (Distance(player.GetPosition(), ghost.second.GetPosition()) < FOG_OF_WAR_RADIUS)
+                if (Distance(player.GetPosition(), ghost.GetPosition()) < FOG_OF_WAR_RADIUS)
                 {
-                    ghost.second.SetState(Ghost::EState::Undefined);
+                    ghost.SetState(Ghost::EState::Undefined);
                     log << '-';
                 }
             }
@@ -853,77 +1028,109 @@ void World::UpdateWorldStateAfterPrevRound(istream& in, ostream& log)
     log << endl;
 }
 
+void World::UpdateSpatialGrids()
+{
+    m_PlayersGrid.Clear();
+    for (auto& player : m_Players)
+    {
+        if (player.IsKnown())
+            m_PlayersGrid.Insert(player);
+    }
+
+    m_EnemiesGrid.Clear();
+    for (auto& enemy : m_Enemies)
+    {
+        if (enemy.IsKnown())
+            m_EnemiesGrid.Insert(enemy);
+    }
+
+    m_GhostsGrid.Clear();
+    for (auto& ghost : m_Ghosts)
+    {
+        if (ghost.IsKnown())
+            m_GhostsGrid.Insert(ghost);
+    }
+}
+
 void World::SimulateNextMove(ostream& out, ostream& log)
 {
+    UpdateSpatialGrids();
+
     for (auto& player : m_Players)
     {
-        player.second.SetDestinationPosition(m_Map.GetRandomDestination(GetRound(), player.second.GetDestinationPosition()));
+        if (!player.IsKnown())
+            continue;
+
+        player.SetDestinationPosition(m_Map.GetRandomDestination(GetRound(), player.GetDestinationPosition()));
     }
 
     for (const auto& enemy : m_Enemies)
     {
-        if (enemy.second.GetState() == Buster::EState::Stunned)
+        if (!enemy.IsKnown())
+            continue;
+
+        if (enemy.GetState() == Buster::EState::Stunned)
             continue;
-        if (enemy.second.IsStunned(GetRound()))
+        if (enemy.IsStunned(GetRound()))
             continue;
-        if (enemy.second.GetLastSeenRound() != GetRound() - 1)
+        if (enemy.GetLastSeenRound() != GetRound() - 1)
             continue;
 
         Player* nearestPlayer = nullptr;
-        int nearestPlayerDistance = numeric_limits<int>::max();
+        int nearestPlayerDist2 = numeric_limits<int>::max();
 
-        for (auto& player : m_Players)
+        m_PlayersGrid.ForEachInRadius(enemy.GetPosition(), STUN_RADIUS, [&](Player& player, int dist2)
         {
-            if (!player.second.CanStunInRound(GetRound()))
-                continue;
-            if (player.second.GetDecision() != Player::EDecision::Move)
-                continue;
+            if (!player.CanStunInRound(GetRound()))
+                return;
+            if (player.GetDecision() != Player::EDecision::Move)
+                return;
 
-            int distance = Distance(player.second.GetPosition(), enemy.second.GetPosition());
-            if (distance <= STUN_RADIUS)
+            if (nearestPlayer && nearestPlayer->GetState() == Buster::EState::Carring && player.GetState() != Buster::EState::Carring)
             {
-                if (nearestPlayer && nearestPlayer->GetState() == Buster::EState::Carring && player.second.GetState() != Buster::EState::Carring)
-                {
-                    nearestPlayer = &player.second;
-                    nearestPlayerDistance = distance;
-                }
-                else if (nearestPlayer && nearestPlayer->GetState() != Buster::EState::Carring && player.second.GetState() == Buster::EState::Carring)
-                {
-                     // Nearest is carring. Do not bust.
-                }
-                else if (distance < nearestPlayerDistance)
-                {
-                    nearestPlayer = &player.second;
-                    nearestPlayerDistance = distance;
-                }
+                nearestPlayer = &player;
+                nearestPlayerDist2 = dist2;
             }
-        }
+            else if (nearestPlayer && nearestPlayer->GetState() != Buster::EState::Carring && player.GetState() == Buster::EState::Carring)
+            {
+                 // Nearest is carring. Do not bust.
+            }
+            else if (dist2 < nearestPlayerDist2)
+            {
+                nearestPlayer = &player;
+                nearestPlayerDist2 = dist2;
+            }
+        });
 
         if (nearestPlayer)
         {
-            nearestPlayer->SetStunEnemy(enemy.second.GetId());
+            nearestPlayer->SetStunEnemy(enemy.GetId());
         }
     }
 
     for (auto& player : m_Players)
     {
-        if (player.second.IsStunned(GetRound()))
+        if (!player.IsKnown())
+            continue;
+
+        if (player.IsStunned(GetRound()))
             continue;
-        if (player.second.GetDecision() != Player::EDecision::Move)
+        if (player.GetDecision() != Player::EDecision::Move)
             continue;
-        if (player.second.GetState() != Buster::EState::Carring)
+        if (player.GetState() != Buster::EState::Carring)
             continue;
 
-        //auto dist = Distance(player.second.GetPosition(), GetPlayerBase().GetReturnPosition());
+        //auto dist = Distance(player.GetPosition(), GetPlayerBase().GetReturnPosition());
         //log << "R " << dist << endl;
 
-        if (GetPlayerBase().IsPositionInside(player.second.GetPosition()))
+        if (GetPlayerBase().IsPositionInside(player.GetPosition()))
         {
-            player.second.SetReleaseGhost();
-            m_Ghosts[player.second.GetCarriedId()].SetBusted();
+            player.SetReleaseGhost();
+            if (IsGhostId(player.GetCarriedId()))
+                m_Ghosts[player.GetCarriedId()].SetBusted();
         }
         else
-            player.second.SetDestinationPosition(GetPlayerBase().GetReturnPosition());
+            player.SetDestinationPosition(GetPlayerBase().GetReturnPosition());
 
         continue;
     }
@@ -932,45 +1139,42 @@ void World::SimulateNextMove(ostream& out, ostream& log)
     int nearestGhostDistance = numeric_limits<int>::max();
     for (auto& ghost : m_Ghosts)
     {
-        if (ghost.second.GetState() == Ghost::EState::Busted ||
-            ghost.second.GetState() == Ghost::EState::Carried)
+        if (!ghost.IsKnown())
             continue;
 
-        if (ghost.second.GetLastSeenRound() != GetRound() - 1)
+        if (ghost.GetState() == Ghost::EState::Busted ||
+            ghost.GetState() == Ghost::EState::Carried)
+            continue;
+
+        if (ghost.GetLastSeenRound() != GetRound() - 1)
         {
-            int lastSeenRound = max(ghost.second.GetLastSeenRound(), ghost.second.GetLastSeenByOtherRound());
+            int lastSeenRound = max(ghost.GetLastSeenRound(), ghost.GetLastSeenByOtherRound());
 
-            log << "Id: " << ghost.second.GetId() << " LastSeenR: " << lastSeenRound << "(" << ghost.second.GetLastSeenRound() << "," << ghost.second.GetLastSeenByOtherRound() << ")" << " Pos:" << ghost.second.GetPosition() << endl;
+            log << "Id: " << ghost.GetId() << " LastSeenR: " << lastSeenRound << "(" << ghost.GetLastSeenRound() << "," << ghost.GetLastSeenByOtherRound() << ")" << " Pos:" << ghost.GetPosition() << endl;
 
-            if (m_Map.IsPlaceVistedInRound(lastSeenRound, ghost.second.GetPosition()))
+            if (m_Map.IsPlaceVistedInRound(lastSeenRound, ghost.GetPosition()))
                 continue;
         }
 
-        int nearestPlayerDistance = numeric_limits<int>::max();
-        for (auto& player : m_Players)
+        const Player* nearestPlayer = m_PlayersGrid.FindNearest(ghost.GetPosition(), [&](const Player& player)
         {
-            if (player.second.IsStunned(GetRound()))
-                continue;
-            if (player.second.GetDecision() != Player::EDecision::Move)
-                continue;
-            if (player.second.GetState() == Buster::EState::Carring)
-                continue;
-
-            auto dist = Distance(player.second.GetPosition(), ghost.second.GetPosition());
-            if (dist < nearestPlayerDistance)
-                nearestPlayerDistance = dist;
-        }
+            return !player.IsStunned(GetRound()) &&
+                player.GetDecision() == Player::EDecision::Move &&
+                player.GetState() != Buster::EState::Carring;
+        });
+        if (!nearestPlayer)
+            continue;
 
-        int dist = nearestPlayerDistance;
-        if (ghost.second.GetStamina() > 0)
-            dist += MOVE_DISTANCE * ghost.second.GetStamina() / 10;
+        int dist = Distance(nearestPlayer->GetPosition(), ghost.GetPosition());
+        if (ghost.GetStamina() > 0)
+            dist += MOVE_DISTANCE * ghost.GetStamina() / 10;
         else
             dist += MOVE_DISTANCE * 40 / 10;
 
         if (dist < nearestGhostDistance)
         {
-            log << "GhostId: " << ghost.second.GetId() << endl;
-            nearestGhost = &ghost.second;
+            log << "GhostId: " << ghost.GetId() << endl;
+            nearestGhost = &ghost;
             nearestGhostDistance = dist;
         }
     }
@@ -979,24 +1183,27 @@ void World::SimulateNextMove(ostream& out, ostream& log)
     {
         for (auto& player : m_Players)
         {
-            if (player.second.IsStunned(GetRound()))
+            if (!player.IsKnown())
                 continue;
-            if (player.second.GetDecision() != Player::EDecision::Move)
+
+            if (player.IsStunned(GetRound()))
+                continue;
+            if (player.GetDecision() != Player::EDecision::Move)
                 continue;
-            if (player.second.GetState() == Buster::EState::Carring)
+            if (player.GetState() == Buster::EState::Carring)
                 continue;
 
-            auto dist = Distance(player.second.GetPosition(), nearestGhost->GetPosition());
+            auto dist = Distance(player.GetPosition(), nearestGhost->GetPosition());
             //log << "B " << dist << '(' << ghost->GetId() << ')' << endl;
 
             if (nearestGhost->GetState() == Ghost::EState::Carried)
             {
-                player.second.SetDestinationPosition(nearestGhost->GetPosition());
+                player.SetDestinationPosition(nearestGhost->GetPosition());
             }
             else
             {
                 if (dist > MAX_GHOST_BUST_RADIUS || nearestGhost->GetLastSeenRound() != GetRound() - 1)
-                    player.second.SetDestinationPosition(nearestGhost->GetPosition());
+                    player.SetDestinationPosition(nearestGhost->GetPosition());
                 else if (dist < MIN_GHOST_BUST_RADIUS)
                 {
                     Vector dir;
@@ -1004,15 +1211,15 @@ void World::SimulateNextMove(ostream& out, ostream& log)
                     if (dist == 0)
                         dir = Vector(GetPlayerBase().GetPosition()) - Vector(nearestGhost->GetPosition());
                     else
-                        dir = Vector(player.second.GetPosition()) - Vector(nearestGhost->GetPosition());
+                        dir = Vector(player.GetPosition()) - Vector(nearestGhost->GetPosition());
                     dir = dir.GetNormalized();
 
                     Point dest_pos = nearestGhost->GetPosition() + dir * (static_cast<float>(MIN_GHOST_BUST_RADIUS));
 
-                    player.second.SetDestinationPosition(dest_pos);
+                    player.SetDestinationPosition(dest_pos);
                 }
                 else
-                    player.second.SetBustGhost(nearestGhost->GetId());
+                    player.SetBustGhost(nearestGhost->GetId());
             }
         }
     }
@@ -1020,12 +1227,13 @@ void World::SimulateNextMove(ostream& out, ostream& log)
 
     for (auto& player : m_Players)
     {
-        player.second.ExecuteDecision(GetRound(), out);
+        if (player.IsKnown())
+            player.ExecuteDecision(GetRound(), out);
     }
 
-    //for (int i = 0; i < (int)m_PlayersVector.size(); ++i)
+    //for (int i = 0; i < (int)m_Players.size(); ++i)
     //{
-    //    auto& player = m_PlayersVector[i];
+    //    auto& player = m_Players[i];
 
     //    log << (player.CanStun(GetRound()) ? 'y' : 'n');
     //    if (player.CanStun(GetRound()))
@@ -1139,70 +1347,6 @@ void World::SimulateNextMove(ostream& out, ostream& log)
     //}
 }
 
-Ghost* FindNearestGhost(const Point& position, map<int, Ghost>& ghosts)
-{
-    int nearestDist = numeric_limits<int>::max();
-    Ghost* nearestGhost = nullptr;
-    for (auto& ghost : ghosts)
-    {
-        if (ghost.second.GetState() == Ghost::EState::Busted ||
-            ghost.second.GetState() == Ghost::EState::Carried)
-        {
-            continue;
-        }
-
-        auto dist = Distance(position, ghost.second.GetPosition()) + ghost.second.GetStamina() * MOVE_DISTANCE / (ghost.second.GetState() != Ghost::EState::Busting ? 1 : 2);
-        if (dist < nearestDist)
-        {
-            nearestDist = dist;
-            nearestGhost = &ghost.second;
-        }
-    }
-
-    return nearestGhost;
-}
-
-Ghost* FindNearestGhostWithState(const Point& position, Ghost::EState state, map<int, Ghost>& ghosts)
-{
-    int nearestDist = numeric_limits<int>::max();
-    Ghost* nearestGhost = nullptr;
-    for (auto& ghost : ghosts)
-    {
-        if (ghost.second.GetState() != state)
-            continue;
-
-        auto dist = Distance(position, ghost.second.GetPosition()) + ghost.second.GetStamina() * MOVE_DISTANCE;
-        if (dist < nearestDist)
-        {
-            nearestDist = dist;
-            nearestGhost = &ghost.second;
-        }
-    }
-
-    return nearestGhost;
-}
-
-Buster* FindNearestNotStunnedEnemy(const Point& position, vector<Buster>& enemies)
-{
-    int nearestDist = numeric_limits<int>::max();
-    int nearestIdx = -1;
-    for (int i = 0; i < (int)enemies.size(); ++i)
-    {
-        const auto& enemy = enemies[i];
-        if (enemy.GetState() == Buster::EState::Stunned || enemy.GetState() == Buster::EState::Moving || enemy.GetId() < 0)
-            continue;
-
-        auto dist = Distance(position, enemy.GetPosition());
-        if (dist < nearestDist)
-        {
-            nearestDist = dist;
-            nearestIdx = i;
-        }
-    }
-
-    return nearestIdx >= 0 ? &enemies[nearestIdx] : nullptr;
-}
-
 /**
 * Send your busters out into the fog to trap ghosts and bring them home!
 **/
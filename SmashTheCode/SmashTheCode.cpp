@@ -1,15 +1,140 @@
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC target("popcnt")
+#endif
+
 #include <iostream>
 #include <array>
 #include <cassert>
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <limits>
+#include <cstdint>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <io.h>
+#elif defined(__BMI2__)
+#include <immintrin.h>
+#endif
+
+#if !defined(_MSC_VER)
+#include <unistd.h>
+#endif
+
+#define USE_BIT_GRID 1
+#define USE_BEAM_SEARCH 1
+#define USE_MONTE_CARLO 0
+#define REUSE_BEAM 0
+#define PARALLEL_SEARCH 0
+#define LOAD_WEIGHTS 0
+#define SEARCH_STATS 0
+#define RECORD_TURNS 0
+#define REPLAY_TURNS 0
+
+#if PARALLEL_SEARCH
+#include <thread>
+#include <atomic>
+#endif
 
 using namespace std;
 
 static const size_t ROTS = 4;
 static const size_t MOVES = 8;
 
+/// Search time budget per turn.
+static const int TURN_TIME_MS = 85;
+/// Number of grids kept at each depth of beam search.
+static const size_t BEAM_WIDTH = 600;
+/// Random pairs added after known pieces in Monte Carlo rollouts.
+static const size_t MONTE_CARLO_MOVES = 8;
+/// Upper limit of Monte Carlo rollouts per root move.
+static const size_t MONTE_CARLO_ROLLOUTS = 1000;
+/// Score lost by Monte Carlo rollout which tops out, more than chain filling whole grid with skulls.
+static const int MONTE_CARLO_DEATH_SCORE = 6 * 70 * 12;
+/// Plies of opponent search used to predict skull drops.
+static const size_t OPPONENT_DEEP = 2;
+/// Worker threads of root-split search when PARALLEL_SEARCH is enabled, 0 uses all cores.
+static const size_t SEARCH_THREADS = 0;
+/// Binary file of turns written when RECORD_TURNS is enabled and played again when REPLAY_TURNS is enabled.
+static const char* const TURN_RECORD_PATH = "SmashTheCode.rec";
+
+#if SEARCH_STATS
+/// Counters of search work of one turn, written to stderr as one line per turn.
+/** Each thread collects own counters, only main thread ones are written. */
+struct SearchStats
+{
+    typedef chrono::steady_clock Clock;
+
+    /// Chains this long or longer share last counter.
+    static const size_t MAX_CHAINS = 8;
+
+    uint64_t nodes[MOVES];
+    uint64_t simulations;
+    uint64_t chains[MAX_CHAINS];
+    Clock::duration rate_time;
+    Clock::duration simulate_time;
+    uint8_t line[MOVES];
+    size_t line_length;
+
+    void Reset()
+    {
+        *this = SearchStats();
+    }
+
+    void AddChains(int steps)
+    {
+        if (steps > 0)
+            ++chains[min((size_t)steps, MAX_CHAINS) - 1];
+    }
+
+    void Print(ostream& out, size_t move, Clock::duration turn_time) const
+    {
+        auto ms = [](Clock::duration time) { return chrono::duration_cast<chrono::microseconds>(time).count() / 1000.0; };
+
+        out << "stats " << ms(turn_time) << "ms nodes";
+        for (size_t deep = 0; deep < MOVES && nodes[deep]; ++deep)
+            out << (deep ? '/' : ' ') << nodes[deep];
+        out << " sim " << simulations << " chains";
+        for (size_t i = 0; i < MAX_CHAINS; ++i)
+        {
+            if (chains[i])
+                out << ' ' << i + 1 << ':' << chains[i];
+        }
+        out << " rate " << ms(rate_time) << "ms simulate " << ms(simulate_time) << "ms pv";
+        if (line_length == 0 || line[0] != move)
+            out << ' ' << move;
+        else
+        {
+            for (size_t i = 0; i < line_length; ++i)
+                out << ' ' << (int)line[i];
+        }
+        out << endl;
+    }
+};
+
+static thread_local SearchStats s_Stats;
+
+/// Adds time of its scope to counter.
+class StatsTimer
+{
+public:
+    explicit StatsTimer(SearchStats::Clock::duration& total) : m_Total(total), m_Start(SearchStats::Clock::now()) {}
+    ~StatsTimer() { m_Total += SearchStats::Clock::now() - m_Start; }
+
+private:
+    SearchStats::Clock::duration& m_Total;
+    SearchStats::Clock::time_point m_Start;
+};
+
+#define STATS(statement) statement
+#else
+#define STATS(statement)
+#endif
+
 template <typename T, std::size_t N>
 constexpr std::size_t countof(T const (&)[N]) noexcept
 {
@@ -19,7 +144,7 @@ constexpr std::size_t countof(T const (&)[N]) noexcept
 template <class T, size_t ROW, size_t COL>
 using matrix = array<array<T, COL>, ROW>;
 
-enum class Block
+enum class Block : int8_t
 {
     Empty = -1,
     Skull,
@@ -91,17 +216,312 @@ inline int GetColorBonus(int colors)
     }
 }
 
+/// Weights of grid rate patterns and thresholds of combo decisions.
+/** Pattern weights are in units of grid rate MUL, thresholds are in skull rows (6 * 70 points).
+    Pattern weights must not be negative, CalculateMaxMoveRate sums them into upper bound used for pruning. */
+struct Weights
+{
+    int height_diff;
+    int skull_color;
+    int inner_column;
+    int vertical_pair;
+    int vertical_three;
+    int horizontal_three;
+    int vertical_split;
+    int bent_three;
+    int over_pair;
+    int over_skull;
+    int step_three;
+    int corner_three;
+    int gap_pair;
+    int horizontal_pair;
+    int chain_potential;
+
+    int combo_rows;
+    int combo_bonus_rows;
+    int answer_rows_1;
+    int answer_threat_rows_1;
+    int answer_rows_2;
+    int answer_threat_rows_2;
+    int answer_rows_3;
+    int answer_threat_rows_3;
+    int threat_rows;
+    int danger_rows;
+    int skull_rows_limit;
+    int empty_rows_limit;
+};
+
+/// Weights of submitted bot, profiles which win self-play are baked here.
+static constexpr Weights DEFAULT_WEIGHTS = {
+    32, 64, 128, 256, 256, 256, 256, 128, 128, 128, 32, 16, 4, 1, 0,
+    2, 2, 3, 1, 2, 3, 1, 6, 8, 12, 4, 2,
+};
+
+#if LOAD_WEIGHTS
+static Weights s_Weights = DEFAULT_WEIGHTS;
+
+inline const Weights& GetWeights()
+{
+    return s_Weights;
+}
+
+/// Reads weights profile, lines of weight name and value, lines starting with # are skipped.
+/** Weights missing in profile keep their default values. Negative pattern weights are rejected. */
+bool LoadWeights(const char* path)
+{
+    // Pattern weights are flagged, they must not be negative.
+    struct WeightName
+    {
+        const char* name;
+        int Weights::* weight;
+        bool pattern;
+    };
+    static const WeightName NAMES[] = {
+        { "height_diff", &Weights::height_diff, true },
+        { "skull_color", &Weights::skull_color, true },
+        { "inner_column", &Weights::inner_column, true },
+        { "vertical_pair", &Weights::vertical_pair, true },
+        { "vertical_three", &Weights::vertical_three, true },
+        { "horizontal_three", &Weights::horizontal_three, true },
+        { "vertical_split", &Weights::vertical_split, true },
+        { "bent_three", &Weights::bent_three, true },
+        { "over_pair", &Weights::over_pair, true },
+        { "over_skull", &Weights::over_skull, true },
+        { "step_three", &Weights::step_three, true },
+        { "corner_three", &Weights::corner_three, true },
+        { "gap_pair", &Weights::gap_pair, true },
+        { "horizontal_pair", &Weights::horizontal_pair, true },
+        { "chain_potential", &Weights::chain_potential, true },
+        { "combo_rows", &Weights::combo_rows, false },
+        { "combo_bonus_rows", &Weights::combo_bonus_rows, false },
+        { "answer_rows_1", &Weights::answer_rows_1, false },
+        { "answer_threat_rows_1", &Weights::answer_threat_rows_1, false },
+        { "answer_rows_2", &Weights::answer_rows_2, false },
+        { "answer_threat_rows_2", &Weights::answer_threat_rows_2, false },
+        { "answer_rows_3", &Weights::answer_rows_3, false },
+        { "answer_threat_rows_3", &Weights::answer_threat_rows_3, false },
+        { "threat_rows", &Weights::threat_rows, false },
+        { "danger_rows", &Weights::danger_rows, false },
+        { "skull_rows_limit", &Weights::skull_rows_limit, false },
+        { "empty_rows_limit", &Weights::empty_rows_limit, false },
+    };
+
+    ifstream in(path);
+    if (!in)
+    {
+        cerr << "Cannot open weights " << path << endl;
+        return false;
+    }
+
+    string name;
+    while (in >> name)
+    {
+        if (name[0] == '#')
+        {
+            getline(in, name);
+            continue;
+        }
+
+        auto it = find_if(begin(NAMES), end(NAMES), [&](const WeightName& entry) { return name == entry.name; });
+        int value;
+        if (it == end(NAMES) || !(in >> value))
+        {
+            cerr << "Bad weight " << name << " in " << path << endl;
+            return false;
+        }
+
+        if (value < 0 && it->pattern)
+        {
+            cerr << "Negative pattern weight " << name << " in " << path << endl;
+            return false;
+        }
+
+        s_Weights.*(it->weight) = value;
+    }
+
+    return true;
+}
+#else
+inline constexpr const Weights& GetWeights()
+{
+    return DEFAULT_WEIGHTS;
+}
+#endif
+
+inline int PopCount(uint64_t bits)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+    return (int)__popcnt64(bits);
+#elif defined(__GNUC__)
+    return __builtin_popcountll(bits);
+#else
+    bits = bits - ((bits >> 1) & 0x5555555555555555ull);
+    bits = (bits & 0x3333333333333333ull) + ((bits >> 2) & 0x3333333333333333ull);
+    bits = (bits + (bits >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+    return (int)((bits * 0x0101010101010101ull) >> 56);
+#endif
+}
+
+/// Counts zero bits below lowest set bit, bits must not be zero.
+inline uint32_t CountTrailingZeros(uint32_t bits)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, bits);
+    return index;
+#elif defined(__GNUC__)
+    return __builtin_ctz(bits);
+#else
+    uint32_t count = 0;
+    while (!(bits & (1u << count)))
+        ++count;
+    return count;
+#endif
+}
+
+/// Packs bits selected by mask into low bits of result (software pext).
+inline uint32_t CompressBits(uint32_t bits, uint32_t mask)
+{
+#if defined(__BMI2__)
+    return _pext_u32(bits, mask);
+#else
+    uint32_t result = 0;
+    for (uint32_t bit = 1; mask; mask &= mask - 1, bit <<= 1)
+    {
+        if (bits & mask & (0u - mask))
+            result |= bit;
+    }
+    return result;
+#endif
+}
+
+/// Sets high bit of every zero byte of value.
+inline uint64_t ZeroBytes(uint64_t bytes)
+{
+    static const uint64_t LOW7 = 0x7F7F7F7F7F7F7F7Full;
+    return ~(((bytes & LOW7) + LOW7) | bytes | LOW7);
+}
+
+/// Repeats byte in all bytes of value.
+inline uint64_t BroadcastByte(uint8_t byte)
+{
+    return 0x0101010101010101ull * byte;
+}
+
+/// Expands high bits of bytes to whole bytes.
+inline uint64_t ExpandHighBits(uint64_t mask)
+{
+    return ((mask >> 7) & 0x0101010101010101ull) * 0xFF;
+}
+
+/// Packs high bits of low eight bytes into one byte, byte i goes to bit i.
+inline uint32_t GatherHighBits(uint64_t mask)
+{
+    return (uint32_t)((((mask >> 7) & 0x0101010101010101ull) * 0x0102040810204080ull) >> 56);
+}
+
+/// Steps SplitMix64 generator and returns next random value.
+inline uint64_t SplitMix64(uint64_t& state)
+{
+    uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+/// Buffered reader of game input.
+/** Takes all input available in one system call, so whole turn block is usually parsed from single read.
+    Tokens are returned as pointers into buffer, valid until next read. */
+class InputReader
+{
+public:
+    static const size_t BUFFER_SIZE = 1 << 12;
+
+    explicit InputReader(int fd) : m_Fd(fd), m_Pos(0), m_End(0) {}
+
+    /// Reads next non-whitespace character.
+    /** Returns false at end of input. */
+    bool ReadChar(char& ch)
+    {
+        const char* token = ReadToken(1);
+        if (!token)
+            return false;
+
+        ch = *token;
+        return true;
+    }
+
+    /// Skips whitespace and returns pointer to next length characters.
+    /** Returns nullptr at end of input. */
+    const char* ReadToken(size_t length)
+    {
+        do
+        {
+            while (m_Pos < m_End && IsSpace(m_Buffer[m_Pos]))
+                ++m_Pos;
+        } while (m_Pos == m_End && Fill(1));
+
+        if (!Fill(length))
+            return nullptr;
+
+        const char* token = m_Buffer + m_Pos;
+        m_Pos += length;
+        return token;
+    }
+
+private:
+    static bool IsSpace(char ch)
+    {
+        return ch == ' ' || ch == '\n' || ch == '\r' || ch == '\t';
+    }
+
+    /// Makes sure at least length characters are buffered.
+    bool Fill(size_t length)
+    {
+        if (m_End - m_Pos >= length)
+            return true;
+
+        memmove(m_Buffer, m_Buffer + m_Pos, m_End - m_Pos);
+        m_End -= m_Pos;
+        m_Pos = 0;
+
+        while (m_End < length)
+        {
+#if defined(_MSC_VER)
+            int bytes = _read(m_Fd, m_Buffer + m_End, (unsigned int)(BUFFER_SIZE - m_End));
+#else
+            ssize_t bytes = read(m_Fd, m_Buffer + m_End, BUFFER_SIZE - m_End);
+#endif
+            if (bytes <= 0)
+                return false;
+
+            m_End += (size_t)bytes;
+        }
+
+        return true;
+    }
+
+    int m_Fd;
+    size_t m_Pos;
+    size_t m_End;
+    char m_Buffer[BUFFER_SIZE];
+};
 
 class Grid
 {
 public:
     static const size_t COLS = 6;
     static const size_t ROWS = 12;
+    /// Cells of row take one byte each, rows are padded with empty cells to one 64-bit word.
+    static const size_t ROW_BYTES = 8;
 
     Grid()
     {
-        //for (auto& row : m_Grid)
-        //    row.fill(Block::Empty);
+        for (auto& row : m_Grid)
+            for (auto& cell : row)
+                cell = Block::Empty;
+        for (auto& height : m_Heights)
+            height = 0;
     }
 
     /// Allows direct read access to grid.
@@ -123,7 +543,14 @@ public:
         if (row >= ROWS || col >= COLS)
             return;
 
+        m_Hash ^= GetZobristKey(row, col, m_Grid[row][col]) ^ GetZobristKey(row, col, block);
         m_Grid[row][col] = block;
+        MarkDirty(row);
+
+        if (!IsEmpty(block))
+            m_Heights[col] = (uint8_t)max<size_t>(m_Heights[col], row + 1);
+        else
+            LowerHeight(col);
     }
     /// Clears vale of specific grid cell.
     void Clear(size_t row, size_t col)
@@ -131,19 +558,36 @@ public:
         if (row >= ROWS || col >= COLS)
             return;
 
+        m_Hash ^= GetZobristKey(row, col, m_Grid[row][col]);
         m_Grid[row][col] = Block::Empty;
+        MarkDirty(row);
+        LowerHeight(col);
+    }
+
+    /// Gets Zobrist hash of grid, updated on every change.
+    uint64_t GetHash() const { return m_Hash; }
+
+    bool operator==(const Grid& other) const
+    {
+        return m_Hash == other.m_Hash && memcmp(m_Grid, other.m_Grid, sizeof(m_Grid)) == 0;
     }
 
+    /// Gets Zobrist key of block in cell, empty cells have no key.
+    static uint64_t GetZobristKey(size_t row, size_t col, Block block)
+    {
+        return IsEmpty(block) ? 0 : s_ZobristKeys.keys[row][col][(size_t)block];
+    }
+
+    /// Gets number of rows up to the top block of column.
+    size_t GetColumnHeight(size_t col) const { return m_Heights[col]; }
+
     size_t GetHeight(size_t row) const
     {
         if (row >= ROWS)
             return 0;
 
-        size_t col = 0;
-        while (col < COLS && m_Grid[row][col] != Block::Empty)
-            ++col;
-
-        return col;
+        // Padding cells are empty, so there is always some empty byte.
+        return CountTrailingZeros(GatherHighBits(ZeroBytes(~LoadRow(row))));
     }
 
     template <typename FUNC>
@@ -160,230 +604,78 @@ public:
     /// Adds new block to grid.
     size_t AddBlock(size_t col, Block color)
     {
-        if (col >= COLS)
+        if (col >= COLS || m_Heights[col] >= ROWS)
             return (size_t)-1;
 
-        for (size_t row = 0; row < ROWS; ++row)
-        {
-            if (m_Grid[row][col] == Block::Empty)
-            {
-                m_Grid[row][col] = color;
-                return row;
-            }
-        }
+        size_t row = m_Heights[col]++;
+        m_Grid[row][col] = color;
+        m_Hash ^= GetZobristKey(row, col, color);
+        MarkDirty(row);
+        return row;
+    }
 
-        return (size_t)-1;
+    /// Adds pair of blocks to grid, first block lands first.
+    /** Grid is not changed if any block does not fit. Columns must be valid. */
+    bool AddBlocks(size_t col1, Block color1, size_t col2, Block color2, size_t& row1, size_t& row2)
+    {
+        if ((size_t)m_Heights[col1] + (col1 == col2 ? 1u : 0u) >= ROWS || (size_t)m_Heights[col2] >= ROWS)
+            return false;
+
+        row1 = AddBlock(col1, color1);
+        row2 = AddBlock(col2, color2);
+        return true;
     }
 
     size_t CalculateBlocksNumber(Block block) const
     {
         size_t num = 0;
         for (size_t row = 0; row < ROWS; ++row)
-        {
-            for (size_t col = 0; col < COLS; ++col)
-            {
-                if (Get(row, col) == block)
-                    ++num;
-            }
-        }
+            num += PopCount(BlockBytes(LoadRow(row), block));
 
         return num;
     }
 
     /// Calculates current grid rate.
-    /** This is custom method of rating grid. */
+    /** This is custom method of rating grid.
+        Cell patterns are cached and only cells near changed blocks are rated again. */
     int CalculateRate() const
     {
         static const int MUL = ROWS*ROWS;
 
-        int rate = 0;
-
-        size_t prev = 0;
-        size_t curr = GetHeight((size_t)-1);
-        size_t next = GetHeight(0);
-        for (size_t row = 0; row < ROWS; ++row)
-        {
-            prev = curr;
-            curr = next;
-            next = GetHeight(row + 1);
+        UpdateCellRates();
 
-            static const int HEIGHT_DIFF_BONUS = 32 * MUL;
+        return CalculateHeightRate() + m_CellsRate * MUL;
+    }
 
-            if (curr - prev >= 2 && curr - prev <= 4)
-                rate += (6 - (curr - prev)) * HEIGHT_DIFF_BONUS;
-            if (prev - curr >= 2 && prev - curr <= 4)
-                rate += (6 - (prev - curr)) * HEIGHT_DIFF_BONUS;
+    /// Calculates grid rate with full scan of all cells.
+    /** Rates cells one by one with CalculateCellRate, which is reference for row kernel of CalculateRowRates. */
+    int CalculateFullRate() const
+    {
+        static const int MUL = ROWS*ROWS;
 
-            if (curr - next >= 2 && curr - next <= 4)
-                rate += (6 - (curr - next)) * HEIGHT_DIFF_BONUS;
-            if (next - curr >= 2 && next - curr <= 4)
-                rate += (6 - (next - curr)) * HEIGHT_DIFF_BONUS;
-        }
-        //for_each_row_and_col([&](size_t row, size_t col)
+        int rate = 0;
         for (size_t row = 0; row < ROWS; ++row)
             for (size_t col = 0; col < COLS; ++col)
-        {
-            Block block = Get(row, col);
-
-            //if (IsEmpty(block))
-            //    rate += 64/*(ROWS - row)*/ * MUL;
-
-            if (IsSkull(block))
-            {
-                //rate -= 256 * MUL;
-
-                if (IsColor(Get(row + 1, col)))
-                    rate += 64 * MUL;
-                if (IsColor(Get(row - 1, col)))
-                    rate += 64 * MUL;
-                if (IsColor(Get(row, col + 1)))
-                    rate += 64 * MUL;
-                if (IsColor(Get(row, col - 1)))
-                    rate += 64 * MUL;
-            }
+                rate += CalculateCellRate(row, col);
 
-            if (IsColor(block))
-            {
-                if (col >= 1 && col < COLS - 1)
-                    rate += 128 * MUL;
-
-                // .
-                // .
-                // x  x..
-                if (Get(row + 1, col + 0) == block &&
-                    Get(row + 2, col + 0) == block)
-                    rate += 256 * MUL;
-                if (Get(row + 0, col + 1) == block &&
-                    Get(row + 0, col + 2) == block)
-                    rate += 256 * MUL;
-
-                //  .  .    .  .
-                //  .  .   .    .
-                // x    x  x    x
-                if (Get(row + 1, col + 1) == block &&
-                    Get(row + 2, col + 1) == block)
-                    rate += 128 * MUL;
-                if (Get(row + 1, col - 1) == block &&
-                    Get(row + 2, col - 1) == block)
-                    rate += 128 * MUL;
-                if (Get(row + 1, col + 0) == block &&
-                    Get(row + 2, col + 1) == block)
-                    rate += 128 * MUL;
-                if (Get(row + 1, col + 0) == block &&
-                    Get(row + 2, col - 1) == block)
-                    rate += 128 * MUL;
-
-                //  ..  ..     x  x
-                // x      x  ..    ..
-                if (Get(row + 1, col + 1) == block &&
-                    Get(row + 1, col + 2) == block)
-                    rate += 32 * MUL;
-                if (Get(row + 1, col - 1) == block &&
-                    Get(row + 1, col - 2) == block)
-                    rate += 32 * MUL;
-                if (Get(row - 1, col - 1) == block &&
-                    Get(row - 1, col - 2) == block)
-                    rate += 32 * MUL;
-                if (Get(row - 1, col + 1) == block &&
-                    Get(row - 1, col + 2) == block)
-                    rate += 32 * MUL;
-
-                // ..  ..   x  x
-                // x    x  ..  ..
-                if (Get(row + 1, col + 0) == block &&
-                    Get(row + 1, col + 1) == block)
-                    rate += 16 * MUL;
-                if (Get(row + 1, col + 0) == block &&
-                    Get(row + 1, col - 1) == block)
-                    rate += 16 * MUL;
-                if (Get(row - 1, col + 0) == block &&
-                    Get(row - 1, col - 1) == block)
-                    rate += 16 * MUL;
-                if (Get(row - 1, col + 0) == block &&
-                    Get(row - 1, col + 1) == block)
-                    rate += 16 * MUL;
-
-                //// .      .  . x  x .
-                //// . x  x .  .      .
-                //if (Get(row + 0, col - 2) == block &&
-                //    Get(row + 1, col - 2) == block)
-                //    rate += 2 * MUL;
-                //if (Get(row + 0, col + 2) == block &&
-                //    Get(row + 1, col + 2) == block)
-                //    rate += 2 * MUL;
-                //if (Get(row - 0, col - 2) == block &&
-                //    Get(row - 1, col - 2) == block)
-                //    rate += 2 * MUL;
-                //if (Get(row - 0, col + 2) == block &&
-                //    Get(row - 1, col + 2) == block)
-                //    rate += 2 * MUL;
-
-                // ..  ..   x  x
-                //
-                //  x  x   ..  ..
-                if (Get(row + 2, col - 0) == block &&
-                    Get(row + 2, col - 1) == block)
-                    rate += 4 * MUL;
-                if (Get(row + 2, col + 0) == block &&
-                    Get(row + 2, col + 1) == block)
-                    rate += 4 * MUL;
-                if (Get(row - 2, col - 0) == block &&
-                    Get(row - 2, col - 1) == block)
-                    rate += 4 * MUL;
-                if (Get(row - 2, col + 0) == block &&
-                    Get(row - 2, col + 1) == block)
-                    rate += 4 * MUL;
-
-                //     .
-                // x.  x
-                if (Get(row, col + 1) == block)
-                    rate += 1 * MUL;
-                if (Get(row + 1, col) == block)
-                    rate += 256 * MUL;
-
-                // .
-                // .
-                //
-                // x
-                if (Get(row + 1, col) != block &&
-                    Get(row + 2, col) == block &&
-                    Get(row + 3, col) == block)
-                    rate += 256 * MUL;
-
-                // .
-                // +
-                // +
-                // x
-                if (Get(row + 1, col) != block &&
-                    IsColor(Get(row + 1, col)) &&
-                    Get(row + 2, col) == Get(row + 1, col) &&
-                    Get(row + 3, col) == block)
-                    rate += 128 * MUL;
-
-                // .
-                // s
-                // x
-                if (IsSkull(Get(row + 1, col)) &&
-                    Get(row + 3, col) == block)
-                    rate += 128 * MUL;
-            }
-        }//);
-
-        return rate;
+        return CalculateHeightRate() + rate * MUL;
     }
-    
+
     /// Simulates next move and calculates score.
-    int Simulate(size_t row1, size_t col1, size_t row2, size_t col2)
+    /** First step only checks groups touching new blocks, next steps only groups touching blocks moved by Colapse.
+        If chains is given, it gets number of clearing steps. */
+    int Simulate(size_t row1, size_t col1, size_t row2, size_t col2, int* chains = nullptr)
     {
+        STATS(++s_Stats.simulations);
+
         int score = 0;
+        int steps = 0;
 
         int chain_power = -1;
 
-        size_t min_row = (size_t)max<ptrdiff_t>(0, min<ptrdiff_t>(row1, row2) - 2);
-        size_t max_row = min((size_t)ROWS, max(row1, row2) + 3);
-
-        size_t min_col = (size_t)max<ptrdiff_t>(0, min<ptrdiff_t>(col1, col2) - 2);
-        size_t max_col = min((size_t)COLS, max(col1, col1) + 3);
+        size_t moved_rows[COLS];
+        for (auto& moved_row : moved_rows)
+            moved_row = ROWS;
 
         do
         {
@@ -391,73 +683,132 @@ public:
             int group_bonus = 0;
             bool colors[(size_t)Block::Count] = { false };
 
-            const int prev_blocks_count = blocks_count;
+            bool visited[ROWS][COLS] = {};
+            size_t cleared_rows[COLS];
+            for (auto& cleared_row : cleared_rows)
+                cleared_row = ROWS;
 
-            //for_each_row_and_col([&](size_t row, size_t col)
-            for (size_t row = min_row; row < max_row; ++row)
-                for (size_t col = min_col; col < max_col; ++col)
+            auto check_group = [&](size_t row, size_t col)
             {
-                if (IsAtLeastFourColorBlocks(row, col))
-                {
-                    colors[(size_t)Get(row, col)] = true;
+                Block block = m_Grid[row][col];
+                if (!IsColor(block) || visited[row][col])
+                    return;
 
-                    int blocks = ClearBlocks(row, col);
+                int blocks = ClearGroup(row, col, visited, cleared_rows);
+                if (blocks)
+                {
+                    colors[(size_t)block] = true;
 
                     blocks_count += blocks;
                     group_bonus += GetGroupBonus(blocks);
                 }
-            }//);
-
-            min_row = 0;
-            max_row = ROWS;
+            };
 
-            min_col = 0;
-            max_col = COLS;
-
-            if (blocks_count != prev_blocks_count)
+            if (chain_power == -1)
+            {
+                check_group(row1, col1);
+                check_group(row2, col2);
+            }
+            else
             {
-                Colapse();
+                // Cleared groups leave holes, so whole column above moved row is checked.
+                for (size_t col = 0; col < COLS; ++col)
+                    for (size_t row = moved_rows[col]; row < ROWS; ++row)
+                        check_group(row, col);
+            }
 
-                if (chain_power == -1)
-                    chain_power = 0;
-                else if (chain_power == 0)
-                    chain_power = 8;
-                else
-                    chain_power *= 2;
+            if (blocks_count == 0)
+                break;
 
-                int colors_count = 0;
-                for (size_t i = 0; i < countof(colors); ++i)
-                {
-                    if (colors[i])
-                        ++colors_count;
-                }
-                int color_bonus = GetColorBonus(colors_count);
+            Colapse(cleared_rows);
+            copy(begin(cleared_rows), end(cleared_rows), begin(moved_rows));
 
-                score += (10 * blocks_count) * max(chain_power + color_bonus + group_bonus, 1);
+            if (chain_power == -1)
+                chain_power = 0;
+            else if (chain_power == 0)
+                chain_power = 8;
+            else
+                chain_power *= 2;
 
-                continue;
+            int colors_count = 0;
+            for (size_t i = 0; i < countof(colors); ++i)
+            {
+                if (colors[i])
+                    ++colors_count;
             }
+            int color_bonus = GetColorBonus(colors_count);
 
-            break;
+            score += (10 * blocks_count) * max(chain_power + color_bonus + group_bonus, 1);
+            ++steps;
 
         } while (true);
 
+        if (chains)
+            *chains = steps;
+
         return score;
     }
 
     void Colapse()
     {
-        for (size_t col = 0; col < COLS; ++col)
+        size_t rows[COLS] = { 0 };
+        Colapse(rows);
+    }
+
+    /// Drops down blocks above rows[col] in every column.
+    /** All columns fall together, each pass moves every block standing over empty cell one row down.
+        On return rows[col] is the lowest row which got block from above or ROWS if nothing has moved. */
+    void Colapse(size_t (&rows)[COLS])
+    {
+        size_t low_row = *min_element(begin(rows), end(rows));
+        for (auto& row : rows)
+            row = ROWS;
+
+        if (low_row >= ROWS)
+            return;
+
+        uint64_t cells[ROWS];
+        for (size_t row = low_row; row < ROWS; ++row)
+            cells[row] = LoadRow(row);
+
+        bool moved;
+        do
+        {
+            moved = false;
+            for (size_t row = low_row; row + 1 < ROWS; ++row)
+            {
+                uint64_t fall = ExpandHighBits(ZeroBytes(~cells[row]) & ~ZeroBytes(~cells[row + 1]) & ROW_CELLS);
+                if (fall)
+                {
+                    cells[row] = (cells[row] & ~fall) | (cells[row + 1] & fall);
+                    cells[row + 1] |= fall;
+                    moved = true;
+                }
+            }
+        } while (moved);
+
+        for (size_t row = low_row; row < ROWS; ++row)
         {
-            for (size_t row = 0, copy_row = 0; row < ROWS; ++row, ++copy_row)
+            uint64_t old_cells = LoadRow(row);
+            uint32_t changed = GatherHighBits(~ZeroBytes(old_cells ^ cells[row]) & ROW_CELLS);
+            if (!changed)
+                continue;
+
+            StoreRow(row, cells[row]);
+            MarkDirty(row);
+
+            for (; changed; changed &= changed - 1)
             {
-                while (copy_row < ROWS && Get(copy_row, col) == Block::Empty)
-                    ++copy_row;
+                size_t col = CountTrailingZeros(changed);
+                Block block = m_Grid[row][col];
 
-                if (row != copy_row)
-                    Set(row, col, Get(copy_row, col));
+                m_Hash ^= GetZobristKey(row, col, (Block)(int8_t)(old_cells >> (col * 8))) ^ GetZobristKey(row, col, block);
+                if (!IsEmpty(block) && rows[col] == ROWS)
+                    rows[col] = row;
             }
         }
+
+        UpdateHeights();
     }
 
     bool IsAtLeastFourColorBlocks(size_t row, size_t col) const
@@ -492,198 +843,2338 @@ public:
 
     void Read(istream& in)
     {
-        static string line;
+        string line;
         for (size_t i = 0; i < ROWS; ++i)
         {
             in >> line; in.ignore();
 
-            ReadRow(ROWS - 1 - i, line);
+            ReadRow(ROWS - 1 - i, line.c_str());
         }
+
+        m_Hash = CalculateHash();
+        MarkAllDirty();
+        UpdateHeights();
     }
 
-    void Read(string (&lines)[ROWS])
+    /// Reads rows directly from input buffer.
+    /** Returns false at end of input. */
+    bool Read(InputReader& in)
     {
         for (size_t i = 0; i < ROWS; ++i)
         {
-            ReadRow(ROWS - 1 - i, lines[i]);
+            const char* line = in.ReadToken(COLS);
+            if (!line)
+                return false;
+
+            ReadRow(ROWS - 1 - i, line);
         }
+
+        m_Hash = CalculateHash();
+        MarkAllDirty();
+        UpdateHeights();
+        return true;
     }
 
-    void Print(ostream& out)
+    void Read(string (&lines)[ROWS])
     {
         for (size_t i = 0; i < ROWS; ++i)
         {
-            size_t row = ROWS - 1 - i;
-            for (size_t col = 0; col < COLS; ++col)
-                out << CharFromBlock(m_Grid[row][col]);
-
-            out << endl;
+            ReadRow(ROWS - 1 - i, lines[i].c_str());
         }
+
+        m_Hash = CalculateHash();
+        MarkAllDirty();
+        UpdateHeights();
     }
 
-private:
-    int ClearBlocks(size_t row, size_t col)
+    /// Cells of grid saved to take back moves.
+    struct Undo
     {
-        int cleared_blocks = 1;
+        uint64_t rows[ROWS];
+        uint64_t hash;
+        uint8_t heights[COLS];
+    };
 
-        Block block = Get(row, col);
-        Clear(row, col);
+    /// Saves cells, so changes made later can be taken back by Restore.
+    void Save(Undo& undo) const
+    {
+        static_assert(sizeof(undo.rows) == sizeof(m_Grid), "Undo rows must cover whole grid.");
 
-        int shift[4][2] = { { 1, 0 },{ -1, 0 },{ 0, 1 },{ 0, -1 } };
+        memcpy(undo.rows, m_Grid, sizeof(undo.rows));
+        undo.hash = m_Hash;
+        memcpy(undo.heights, m_Heights, sizeof(undo.heights));
+    }
 
-        for (size_t i = 0; i < 4; ++i)
+    /// Takes back changes made after Save.
+    /** Only changed rows are written back, their cached rates are updated on next rating. */
+    void Restore(const Undo& undo)
+    {
+        for (size_t row = 0; row < ROWS; ++row)
         {
-            if (Get(row + shift[i][0], col + shift[i][1]) == block)
-                cleared_blocks += ClearBlocks(row + shift[i][0], col + shift[i][1]);
-            else if (Get(row + shift[i][0], col + shift[i][1]) == Block::Skull)
-                Clear(row + shift[i][0], col + shift[i][1]);
+            if (LoadRow(row) != undo.rows[row])
+            {
+                StoreRow(row, undo.rows[row]);
+                MarkDirty(row);
+            }
         }
 
-        return cleared_blocks;
+        m_Hash = undo.hash;
+        memcpy(m_Heights, undo.heights, sizeof(m_Heights));
     }
 
-    void ReadRow(size_t row, const string& line)
+    void Print(ostream& out) const
     {
-        //assert(row < ROWS);
+        for (size_t i = 0; i < ROWS; ++i)
+        {
+            size_t row = ROWS - 1 - i;
+            for (size_t col = 0; col < COLS; ++col)
+                out << CharFromBlock(m_Grid[row][col]);
 
-        for (size_t i = 0; i < COLS; ++i)
-            m_Grid[row][i] = BlockFromChar(line[i]);
+            out << endl;
+        }
     }
 
-    //matrix<Block, ROWS, COLS> m_Grid;
-    Block m_Grid[ROWS][COLS];
-};
-
-pair<int, int> CalculateMove(const Grid& grid, size_t col, size_t rot, Block(&colorsA)[MOVES], Block(&colorsB)[MOVES], int deep, int max_deep, int deep_bonus);
-
-int CalculateBestMove(const Grid& grid, Block(&colorsA)[MOVES], Block(&colorsB)[MOVES], int deep, int max_deep, int deep_bonus)
-{
-    int values[Grid::COLS * ROTS] = { 0 };
-
-    for (size_t col = 0; col < Grid::COLS; ++col)
+private:
+    /// Calculates rate of differences between neighbouring row heights.
+    int CalculateHeightRate() const
     {
-        for (size_t rot = 0; rot < ROTS; ++rot)
-        {
-            values[col * ROTS + rot] = CalculateMove(grid, col, rot, colorsA, colorsB, deep, max_deep, deep_bonus).first;
-        }
-    }
+        static const int MUL = ROWS*ROWS;
 
-    return *max_element(begin(values), end(values));
-}
+        int rate = 0;
 
-inline bool AddBlocksToGrid(Grid& calc_grid, size_t col, size_t rot, Block(&colorsA)[MOVES], Block(&colorsB)[MOVES], int deep, size_t& row1, size_t& col1, size_t& row2, size_t& col2)
-{
-    if (rot == 0)
-    {
-        col1 = col;
-        col2 = col + 1;
-        row1 = calc_grid.AddBlock(col, colorsA[deep]);
-        row2 = calc_grid.AddBlock(col + 1, colorsB[deep]);
+        size_t prev = 0;
+        size_t curr = GetHeight((size_t)-1);
+        size_t next = GetHeight(0);
+        for (size_t row = 0; row < ROWS; ++row)
+        {
+            prev = curr;
+            curr = next;
+            next = GetHeight(row + 1);
+
+            const int HEIGHT_DIFF_BONUS = GetWeights().height_diff * MUL;
+
+            if (curr - prev >= 2 && curr - prev <= 4)
+                rate += (6 - (curr - prev)) * HEIGHT_DIFF_BONUS;
+            if (prev - curr >= 2 && prev - curr <= 4)
+                rate += (6 - (prev - curr)) * HEIGHT_DIFF_BONUS;
+
+            if (curr - next >= 2 && curr - next <= 4)
+                rate += (6 - (curr - next)) * HEIGHT_DIFF_BONUS;
+            if (next - curr >= 2 && next - curr <= 4)
+                rate += (6 - (next - curr)) * HEIGHT_DIFF_BONUS;
+        }
+
+        return rate;
+    }
+
+    /// Calculates rate of patterns starting at cell, in MUL units.
+    /** Reads cells up to 3 rows above, 2 rows below and 2 columns aside. */
+    int CalculateCellRate(size_t row, size_t col) const
+    {
+        const Weights& weights = GetWeights();
+
+        int rate = 0;
+
+        Block block = Get(row, col);
+
+        //if (IsEmpty(block))
+        //    rate += 64/*(ROWS - row)*/;
+
+        if (IsSkull(block))
+        {
+            //rate -= 256;
+
+            if (IsColor(Get(row + 1, col)))
+                rate += weights.skull_color;
+            if (IsColor(Get(row - 1, col)))
+                rate += weights.skull_color;
+            if (IsColor(Get(row, col + 1)))
+                rate += weights.skull_color;
+            if (IsColor(Get(row, col - 1)))
+                rate += weights.skull_color;
+        }
+
+        if (IsColor(block))
+        {
+            if (col >= 1 && col < COLS - 1)
+                rate += weights.inner_column;
+
+            // .
+            // .
+            // x  x..
+            if (Get(row + 1, col + 0) == block &&
+                Get(row + 2, col + 0) == block)
+                rate += weights.vertical_three;
+            if (Get(row + 0, col + 1) == block &&
+                Get(row + 0, col + 2) == block)
+                rate += weights.horizontal_three;
+
+            //  .  .    .  .
+            //  .  .   .    .
+            // x    x  x    x
+            if (Get(row + 1, col + 1) == block &&
+                Get(row + 2, col + 1) == block)
+                rate += weights.bent_three;
+            if (Get(row + 1, col - 1) == block &&
+                Get(row + 2, col - 1) == block)
+                rate += weights.bent_three;
+            if (Get(row + 1, col + 0) == block &&
+                Get(row + 2, col + 1) == block)
+                rate += weights.bent_three;
+            if (Get(row + 1, col + 0) == block &&
+                Get(row + 2, col - 1) == block)
+                rate += weights.bent_three;
+
+            //  ..  ..     x  x
+            // x      x  ..    ..
+            if (Get(row + 1, col + 1) == block &&
+                Get(row + 1, col + 2) == block)
+                rate += weights.step_three;
+            if (Get(row + 1, col - 1) == block &&
+                Get(row + 1, col - 2) == block)
+                rate += weights.step_three;
+            if (Get(row - 1, col - 1) == block &&
+                Get(row - 1, col - 2) == block)
+                rate += weights.step_three;
+            if (Get(row - 1, col + 1) == block &&
+                Get(row - 1, col + 2) == block)
+                rate += weights.step_three;
+
+            // ..  ..   x  x
+            // x    x  ..  ..
+            if (Get(row + 1, col + 0) == block &&
+                Get(row + 1, col + 1) == block)
+                rate += weights.corner_three;
+            if (Get(row + 1, col + 0) == block &&
+                Get(row + 1, col - 1) == block)
+                rate += weights.corner_three;
+            if (Get(row - 1, col + 0) == block &&
+                Get(row - 1, col - 1) == block)
+                rate += weights.corner_three;
+            if (Get(row - 1, col + 0) == block &&
+                Get(row - 1, col + 1) == block)
+                rate += weights.corner_three;
+
+            //// .      .  . x  x .
+            //// . x  x .  .      .
+            //if (Get(row + 0, col - 2) == block &&
+            //    Get(row + 1, col - 2) == block)
+            //    rate += 2;
+            //if (Get(row + 0, col + 2) == block &&
+            //    Get(row + 1, col + 2) == block)
+            //    rate += 2;
+            //if (Get(row - 0, col - 2) == block &&
+            //    Get(row - 1, col - 2) == block)
+            //    rate += 2;
+            //if (Get(row - 0, col + 2) == block &&
+            //    Get(row - 1, col + 2) == block)
+            //    rate += 2;
+
+            // ..  ..   x  x
+            //
+            //  x  x   ..  ..
+            if (Get(row + 2, col - 0) == block &&
+                Get(row + 2, col - 1) == block)
+                rate += weights.gap_pair;
+            if (Get(row + 2, col + 0) == block &&
+                Get(row + 2, col + 1) == block)
+                rate += weights.gap_pair;
+            if (Get(row - 2, col - 0) == block &&
+                Get(row - 2, col - 1) == block)
+                rate += weights.gap_pair;
+            if (Get(row - 2, col + 0) == block &&
+                Get(row - 2, col + 1) == block)
+                rate += weights.gap_pair;
+
+            //     .
+            // x.  x
+            if (Get(row, col + 1) == block)
+                rate += weights.horizontal_pair;
+            if (Get(row + 1, col) == block)
+                rate += weights.vertical_pair;
+
+            // .
+            // .
+            //
+            // x
+            if (Get(row + 1, col) != block &&
+                Get(row + 2, col) == block &&
+                Get(row + 3, col) == block)
+                rate += weights.vertical_split;
+
+            // .
+            // +
+            // +
+            // x
+            if (Get(row + 1, col) != block &&
+                IsColor(Get(row + 1, col)) &&
+                Get(row + 2, col) == Get(row + 1, col) &&
+                Get(row + 3, col) == block)
+                rate += weights.over_pair;
+
+            // .
+            // s
+            // x
+            if (IsSkull(Get(row + 1, col)) &&
+                Get(row + 3, col) == block)
+                rate += weights.over_skull;
+        }
+
+        return rate;
+    }
+
+    /// Calculates CalculateCellRate of all cells in row at once.
+    /** Patterns are tested with byte compares of whole rows, so every column of row is rated together. */
+    void CalculateRowRates(size_t row, int (&rates)[COLS]) const
+    {
+        const Weights& weights = GetWeights();
+
+        uint64_t cells[6];
+        for (size_t i = 0; i < countof(cells); ++i)
+            cells[i] = LoadRow(row + i - 2);
+
+        auto cells_at = [&](int drow) { return cells[drow + 2]; };
+
+        uint64_t blocks = cells_at(0);
+        uint64_t colors = ColorBytes(blocks);
+        uint64_t skulls = BlockBytes(blocks, Block::Skull);
+
+        auto same = [&](int drow, int dcol) { return ZeroBytes(blocks ^ ShiftCols(cells_at(drow), dcol)) & colors; };
+        auto add = [&](uint64_t mask, int rate)
+        {
+            for (uint32_t cols = GatherHighBits(mask); cols; cols &= cols - 1)
+                rates[CountTrailingZeros(cols)] += rate;
+        };
+
+        add(skulls & ColorBytes(cells_at(1)), weights.skull_color);
+        add(skulls & ColorBytes(cells_at(-1)), weights.skull_color);
+        add(skulls & ColorBytes(ShiftCols(blocks, 1)), weights.skull_color);
+        add(skulls & ColorBytes(ShiftCols(blocks, -1)), weights.skull_color);
+
+        add(colors & MIDDLE_CELLS, weights.inner_column);
+
+        add(same(1, 0) & same(2, 0), weights.vertical_three);
+        add(same(0, 1) & same(0, 2), weights.horizontal_three);
+
+        add(same(1, 1) & same(2, 1), weights.bent_three);
+        add(same(1, -1) & same(2, -1), weights.bent_three);
+        add(same(1, 0) & same(2, 1), weights.bent_three);
+        add(same(1, 0) & same(2, -1), weights.bent_three);
+
+        add(same(1, 1) & same(1, 2), weights.step_three);
+        add(same(1, -1) & same(1, -2), weights.step_three);
+        add(same(-1, -1) & same(-1, -2), weights.step_three);
+        add(same(-1, 1) & same(-1, 2), weights.step_three);
+
+        add(same(1, 0) & same(1, 1), weights.corner_three);
+        add(same(1, 0) & same(1, -1), weights.corner_three);
+        add(same(-1, 0) & same(-1, -1), weights.corner_three);
+        add(same(-1, 0) & same(-1, 1), weights.corner_three);
+
+        add(same(2, 0) & same(2, -1), weights.gap_pair);
+        add(same(2, 0) & same(2, 1), weights.gap_pair);
+        add(same(-2, 0) & same(-2, -1), weights.gap_pair);
+        add(same(-2, 0) & same(-2, 1), weights.gap_pair);
+
+        add(same(0, 1), weights.horizontal_pair);
+        add(same(1, 0), weights.vertical_pair);
+
+        add(~same(1, 0) & same(2, 0) & same(3, 0), weights.vertical_split);
+        add(colors & ~same(1, 0) & ColorBytes(cells_at(1)) & ZeroBytes(cells_at(1) ^ cells_at(2)) & same(3, 0), weights.over_pair);
+        add(colors & BlockBytes(cells_at(1), Block::Skull) & same(3, 0), weights.over_skull);
+    }
+
+    /// Marks rows which patterns read given row.
+    void MarkDirty(size_t row)
+    {
+        m_DirtyRows |= (uint16_t)(((0x3Fu << row) >> 3) & ((1u << ROWS) - 1));
+    }
+
+    void MarkAllDirty()
+    {
+        m_DirtyRows = (uint16_t)((1u << ROWS) - 1);
+    }
+
+    void UpdateCellRates() const
+    {
+        for (uint32_t rows = m_DirtyRows; rows; rows &= rows - 1)
+        {
+            size_t row = CountTrailingZeros(rows);
+
+            int rates[COLS] = { 0 };
+            CalculateRowRates(row, rates);
+
+            for (size_t col = 0; col < COLS; ++col)
+            {
+                m_CellsRate += rates[col] - m_CellRates[row][col];
+                m_CellRates[row][col] = rates[col];
+            }
+        }
+
+        m_DirtyRows = 0;
+    }
+
+    /// Sets column heights from numbers of blocks, columns must have no holes.
+    void UpdateHeights()
+    {
+        uint64_t heights = 0;
+        for (size_t row = 0; row < ROWS; ++row)
+            heights += (~ZeroBytes(~LoadRow(row)) & ROW_CELLS) >> 7;
+
+        for (size_t col = 0; col < COLS; ++col)
+            m_Heights[col] = (uint8_t)(heights >> (col * 8));
+    }
+
+    /// Lowers column height below cleared top blocks.
+    void LowerHeight(size_t col)
+    {
+        while (m_Heights[col] > 0 && IsEmpty(m_Grid[m_Heights[col] - 1][col]))
+            --m_Heights[col];
+    }
+
+    /// Gets cells of row as bytes of 64-bit word, rows outside grid are empty.
+    uint64_t LoadRow(size_t row) const
+    {
+        if (row >= ROWS)
+            return EMPTY_ROW;
+
+        uint64_t cells;
+        memcpy(&cells, m_Grid[row], sizeof(cells));
+        return cells;
+    }
+
+    void StoreRow(size_t row, uint64_t cells)
+    {
+        memcpy(m_Grid[row], &cells, sizeof(cells));
+    }
+
+    /// Gets high bits of row bytes equal to block.
+    static uint64_t BlockBytes(uint64_t cells, Block block)
+    {
+        return ZeroBytes(cells ^ BroadcastByte((uint8_t)block)) & ROW_CELLS;
+    }
+
+    /// Gets high bits of row bytes with color blocks.
+    static uint64_t ColorBytes(uint64_t cells)
+    {
+        return ROW_CELLS & ~BlockBytes(cells, Block::Empty) & ~BlockBytes(cells, Block::Skull);
+    }
+
+    /// Moves row bytes so byte col gets cell col + dcol, cells outside grid are empty.
+    static uint64_t ShiftCols(uint64_t cells, int dcol)
+    {
+        if (dcol > 0)
+            return (cells >> (8 * dcol)) | (EMPTY_ROW << (64 - 8 * dcol));
+        if (dcol < 0)
+            return (cells << (-8 * dcol)) | (EMPTY_ROW >> (64 + 8 * dcol));
+        return cells;
+    }
+
+    /// Clears group of the same color blocks connected to cell if it has at least 4 blocks.
+    /** Walks group with explicit worklist, visited cells are marked so other seeds skip them.
+        Skulls next to cleared group are cleared too. Lowest cleared row of every column is kept in cleared_rows.
+        Returns number of cleared color blocks. */
+    int ClearGroup(size_t row, size_t col, bool (&visited)[ROWS][COLS], size_t (&cleared_rows)[COLS])
+    {
+        static const int shift[4][2] = { { 1, 0 },{ -1, 0 },{ 0, 1 },{ 0, -1 } };
+
+        Block block = m_Grid[row][col];
+
+        uint8_t group[ROWS * COLS];
+        size_t group_size = 0;
+
+        visited[row][col] = true;
+        group[group_size++] = (uint8_t)(row * COLS + col);
+
+        // Group cells double as worklist, cells after head are still to be expanded.
+        for (size_t head = 0; head < group_size; ++head)
+        {
+            size_t cell_row = group[head] / COLS;
+            size_t cell_col = group[head] % COLS;
+
+            for (size_t i = 0; i < 4; ++i)
+            {
+                size_t next_row = cell_row + shift[i][0];
+                size_t next_col = cell_col + shift[i][1];
+                if (Get(next_row, next_col) == block && !visited[next_row][next_col])
+                {
+                    visited[next_row][next_col] = true;
+                    group[group_size++] = (uint8_t)(next_row * COLS + next_col);
+                }
+            }
+        }
+
+        if (group_size < 4)
+            return 0;
+
+        auto clear = [&](size_t clear_row, size_t clear_col)
+        {
+            Clear(clear_row, clear_col);
+            cleared_rows[clear_col] = min(cleared_rows[clear_col], clear_row);
+        };
+
+        for (size_t i = 0; i < group_size; ++i)
+        {
+            size_t cell_row = group[i] / COLS;
+            size_t cell_col = group[i] % COLS;
+
+            clear(cell_row, cell_col);
+
+            for (size_t j = 0; j < 4; ++j)
+            {
+                if (Get(cell_row + shift[j][0], cell_col + shift[j][1]) == Block::Skull)
+                    clear(cell_row + shift[j][0], cell_col + shift[j][1]);
+            }
+        }
+
+        return (int)group_size;
+    }
+
+    void ReadRow(size_t row, const char* line)
+    {
+        //assert(row < ROWS);
+
+        for (size_t i = 0; i < COLS; ++i)
+            m_Grid[row][i] = BlockFromChar(line[i]);
+    }
+
+    uint64_t CalculateHash() const
+    {
+        uint64_t hash = 0;
+        for (size_t row = 0; row < ROWS; ++row)
+            for (size_t col = 0; col < COLS; ++col)
+                hash ^= GetZobristKey(row, col, m_Grid[row][col]);
+
+        return hash;
+    }
+
+    struct ZobristKeys
+    {
+        ZobristKeys()
+        {
+            uint64_t state = 0x5AD5AD5AD5AD5AD5ull;
+            for (auto& row : keys)
+                for (auto& cell : row)
+                    for (auto& key : cell)
+                        key = SplitMix64(state);
+        }
+
+        uint64_t keys[ROWS][COLS][(size_t)Block::Count];
+    };
+    static const ZobristKeys s_ZobristKeys;
+
+    /// High bits of row bytes of grid cells, little-endian rows.
+    static const uint64_t ROW_CELLS = 0x0000808080808080ull;
+    /// High bits of row bytes of cells not in border columns.
+    static const uint64_t MIDDLE_CELLS = 0x0000008080808000ull;
+    static const uint64_t EMPTY_ROW = ~0ull;
+
+    //matrix<Block, ROWS, COLS> m_Grid;
+    Block m_Grid[ROWS][ROW_BYTES];
+    uint64_t m_Hash = 0;
+
+    /// Cached CalculateCellRate of every cell and their sum.
+    mutable int m_CellRates[ROWS][COLS] = {};
+    mutable int m_CellsRate = 0;
+    /// Rows which cached cell rates are out of date.
+    mutable uint16_t m_DirtyRows = 0;
+
+    /// Number of rows up to the top block of every column.
+    uint8_t m_Heights[COLS];
+};
+
+const Grid::ZobristKeys Grid::s_ZobristKeys;
+
+/// 128-bit mask of grid cells.
+/** Each column takes 16 bits (12 rows and 4 padding bits), so cell (row, col) is bit col * 16 + row.
+    Columns 0-3 live in low word and columns 4-5 in high word. Padding bits are always kept clear. */
+class BitBoard
+{
+public:
+    static const size_t COL_BITS = 16;
+
+    static_assert(Grid::ROWS == 12 && Grid::COLS == 6, "BitBoard masks are hard-coded for 12x6 grid.");
+
+    BitBoard() : m_Lo(0), m_Hi(0) {}
+    BitBoard(uint64_t lo, uint64_t hi) : m_Lo(lo), m_Hi(hi) {}
+
+    static BitBoard All() { return BitBoard(0x0FFF0FFF0FFF0FFFull, 0x0FFF0FFFull); }
+    static BitBoard Cell(size_t row, size_t col)
+    {
+        size_t bit = col * COL_BITS + row;
+        return bit < 64 ? BitBoard(1ull << bit, 0) : BitBoard(0, 1ull << (bit - 64));
+    }
+
+    bool Test(size_t row, size_t col) const
+    {
+        if (row >= Grid::ROWS || col >= Grid::COLS)
+            return false;
+
+        return (*this & Cell(row, col)).Any();
+    }
+
+    uint64_t GetLow() const { return m_Lo; }
+    uint64_t GetHigh() const { return m_Hi; }
+
+    bool Any() const { return (m_Lo | m_Hi) != 0; }
+    int Count() const { return PopCount(m_Lo) + PopCount(m_Hi); }
+
+    /// Gets single set bit with lowest index.
+    BitBoard Lowest() const
+    {
+        if (m_Lo)
+            return BitBoard(m_Lo & (0ull - m_Lo), 0);
+        return BitBoard(0, m_Hi & (0ull - m_Hi));
+    }
+
+    uint32_t GetColumn(size_t col) const
+    {
+        size_t bit = col * COL_BITS;
+        return (uint32_t)((bit < 64 ? m_Lo >> bit : m_Hi >> (bit - 64)) & 0xFFFF);
+    }
+    void SetColumn(size_t col, uint32_t bits)
+    {
+        size_t bit = col * COL_BITS;
+        uint64_t& word = bit < 64 ? m_Lo : m_Hi;
+        bit &= 63;
+        word = (word & ~(0xFFFFull << bit)) | ((uint64_t)bits << bit);
+    }
+
+    /// Gets mask of cells (row, col) for which cell (row + DROW, col + DCOL) is set.
+    /** Cells shifted in from outside of grid are clear. Works for |DROW| <= 4. */
+    template <int DROW, int DCOL>
+    BitBoard Shifted() const
+    {
+        static const int SHIFT = DROW + DCOL * (int)COL_BITS;
+        static_assert(SHIFT > -64 && SHIFT < 64, "Shift out of range.");
+
+        if (SHIFT > 0)
+            return BitBoard((m_Lo >> (SHIFT & 63)) | (m_Hi << ((64 - SHIFT) & 63)), m_Hi >> (SHIFT & 63)) & All();
+        if (SHIFT < 0)
+            return BitBoard(m_Lo << (-SHIFT & 63), (m_Hi << (-SHIFT & 63)) | (m_Lo >> ((64 + SHIFT) & 63))) & All();
+        return *this;
+    }
+
+    /// Gets cells which are orthogonal neighbours of any set cell.
+    BitBoard Neighbours() const
+    {
+        return Shifted<1, 0>() | Shifted<-1, 0>() | Shifted<0, 1>() | Shifted<0, -1>();
+    }
+
+    BitBoard operator&(const BitBoard& other) const { return BitBoard(m_Lo & other.m_Lo, m_Hi & other.m_Hi); }
+    BitBoard operator|(const BitBoard& other) const { return BitBoard(m_Lo | other.m_Lo, m_Hi | other.m_Hi); }
+    BitBoard operator^(const BitBoard& other) const { return BitBoard(m_Lo ^ other.m_Lo, m_Hi ^ other.m_Hi); }
+    BitBoard operator~() const { return *this ^ All(); }
+    BitBoard& operator&=(const BitBoard& other) { m_Lo &= other.m_Lo; m_Hi &= other.m_Hi; return *this; }
+    BitBoard& operator|=(const BitBoard& other) { m_Lo |= other.m_Lo; m_Hi |= other.m_Hi; return *this; }
+    bool operator==(const BitBoard& other) const { return m_Lo == other.m_Lo && m_Hi == other.m_Hi; }
+    bool operator!=(const BitBoard& other) const { return !(*this == other); }
+
+private:
+    uint64_t m_Lo;
+    uint64_t m_Hi;
+};
+
+/// Bitboard grid backend.
+/** Keeps one mask per skull and color, so whole board is 6 x 16 bytes and group search,
+    clearing, gravity and rating are done with shifts, ANDs and popcounts.
+    Has the same interface and results as Grid. */
+class BitGrid
+{
+public:
+    static const size_t COLS = Grid::COLS;
+    static const size_t ROWS = Grid::ROWS;
+    static const size_t LAYERS = (size_t)Block::Count;
+
+    BitGrid() {}
+
+    /// Gets value of specified grid cell.
+    /** If row or col is outside bounds then returns Block::Empty. */
+    Block Get(size_t row, size_t col) const
+    {
+        if (row >= ROWS || col >= COLS)
+            return Block::Empty;
+
+        BitBoard cell = BitBoard::Cell(row, col);
+        for (size_t layer = 0; layer < LAYERS; ++layer)
+        {
+            if ((m_Layers[layer] & cell).Any())
+                return (Block)layer;
+        }
+
+        return Block::Empty;
+    }
+    /// Sets value of specific grid cell.
+    void Set(size_t row, size_t col, Block block)
+    {
+        if (row >= ROWS || col >= COLS)
+            return;
+
+        Clear(row, col);
+        if (!IsEmpty(block))
+            m_Layers[(size_t)block] |= BitBoard::Cell(row, col);
+    }
+    /// Clears vale of specific grid cell.
+    void Clear(size_t row, size_t col)
+    {
+        if (row >= ROWS || col >= COLS)
+            return;
+
+        BitBoard mask = ~BitBoard::Cell(row, col);
+        for (auto& layer : m_Layers)
+            layer &= mask;
+    }
+
+    size_t GetNumRows() const { return ROWS; }
+    size_t GetNumCols() const { return COLS; }
+
+    /// Gets hash of grid.
+    /** Mixes layer masks directly, which is cheaper than keeping Zobrist hash through mask operations. */
+    uint64_t GetHash() const
+    {
+        uint64_t hash = 0;
+        for (const auto& layer : m_Layers)
+        {
+            hash = (hash ^ layer.GetLow()) * 0x9E3779B97F4A7C15ull;
+            hash = (hash ^ layer.GetHigh()) * 0xBF58476D1CE4E5B9ull;
+        }
+
+        return hash ^ (hash >> 31);
+    }
+
+    bool operator==(const BitGrid& other) const
+    {
+        return equal(begin(m_Layers), end(m_Layers), begin(other.m_Layers));
+    }
+
+    /// Adds new block to grid.
+    size_t AddBlock(size_t col, Block color)
+    {
+        if (col >= COLS)
+            return (size_t)-1;
+
+        size_t row = (size_t)PopCount(GetOccupied().GetColumn(col));
+        if (row >= ROWS)
+            return (size_t)-1;
+
+        m_Layers[(size_t)color] |= BitBoard::Cell(row, col);
+        return row;
+    }
+
+    /// Adds pair of blocks to grid, first block lands first.
+    /** Grid is not changed if any block does not fit. Columns must be valid. */
+    bool AddBlocks(size_t col1, Block color1, size_t col2, Block color2, size_t& row1, size_t& row2)
+    {
+        BitBoard occupied = GetOccupied();
+        row1 = (size_t)PopCount(occupied.GetColumn(col1));
+        row2 = (size_t)PopCount(occupied.GetColumn(col2)) + (col1 == col2 ? 1 : 0);
+        if (row1 >= ROWS || row2 >= ROWS)
+            return false;
+
+        m_Layers[(size_t)color1] |= BitBoard::Cell(row1, col1);
+        m_Layers[(size_t)color2] |= BitBoard::Cell(row2, col2);
+        return true;
+    }
+
+    size_t CalculateBlocksNumber(Block block) const
+    {
+        if (IsEmpty(block))
+            return ROWS * COLS - GetOccupied().Count();
+
+        return m_Layers[(size_t)block].Count();
+    }
+
+    /// Calculates current grid rate.
+    /** Bitboard version of Grid::CalculateRate, every pattern is counted for all cells at once. */
+    int CalculateRate() const
+    {
+        static const int MUL = ROWS*ROWS;
+        const Weights& weights = GetWeights();
+        const int HEIGHT_DIFF_BONUS = weights.height_diff * MUL;
+
+        int rate = 0;
+
+        // Same row "heights" as Grid::GetHeight, padded with zero height row on both sides.
+        size_t heights[ROWS + 2] = { 0 };
+        BitBoard occupied = GetOccupied();
+        uint32_t run = 0xFFFF;
+        for (size_t col = 0; col < COLS; ++col)
+        {
+            run &= occupied.GetColumn(col);
+            for (uint32_t bits = run; bits; bits &= bits - 1)
+                ++heights[CountTrailingZeros(bits) + 1];
+        }
+
+        for (size_t row = 0; row < ROWS; ++row)
+        {
+            size_t prev = heights[row];
+            size_t curr = heights[row + 1];
+            size_t next = heights[row + 2];
+
+            if (curr - prev >= 2 && curr - prev <= 4)
+                rate += (6 - (curr - prev)) * HEIGHT_DIFF_BONUS;
+            if (prev - curr >= 2 && prev - curr <= 4)
+                rate += (6 - (prev - curr)) * HEIGHT_DIFF_BONUS;
+
+            if (curr - next >= 2 && curr - next <= 4)
+                rate += (6 - (curr - next)) * HEIGHT_DIFF_BONUS;
+            if (next - curr >= 2 && next - curr <= 4)
+                rate += (6 - (next - curr)) * HEIGHT_DIFF_BONUS;
+        }
+
+        const BitBoard& skulls = m_Layers[(size_t)Block::Skull];
+        BitBoard colors = GetColors();
+
+        rate += weights.skull_color * MUL * ((skulls & colors.Shifted<1, 0>()).Count() + (skulls & colors.Shifted<-1, 0>()).Count() +
+                            (skulls & colors.Shifted<0, 1>()).Count() + (skulls & colors.Shifted<0, -1>()).Count());
+
+        const BitBoard INNER_COLS(0x0FFF0FFF0FFF0000ull, 0x00000FFFull);
+        rate += weights.inner_column * MUL * (colors & INNER_COLS).Count();
+
+        // Vertical pairs of the same color, used by "+ + x" pattern below.
+        BitBoard pairs[LAYERS];
+        for (size_t layer = (size_t)Block::Color1; layer < LAYERS; ++layer)
+            pairs[layer] = m_Layers[layer].Shifted<1, 0>() & m_Layers[layer].Shifted<2, 0>();
+
+        BitBoard skulls_up = skulls.Shifted<1, 0>();
+
+        for (size_t layer = (size_t)Block::Color1; layer < LAYERS; ++layer)
+        {
+            const BitBoard& b = m_Layers[layer];
+            if (!b.Any())
+                continue;
+
+            BitBoard u1 = b.Shifted<1, 0>();
+            BitBoard u2 = b.Shifted<2, 0>();
+            BitBoard u3 = b.Shifted<3, 0>();
+            BitBoard d1 = b.Shifted<-1, 0>();
+            BitBoard d2 = b.Shifted<-2, 0>();
+            BitBoard r1 = b.Shifted<0, 1>();
+            BitBoard u1r1 = b.Shifted<1, 1>();
+            BitBoard u1l1 = b.Shifted<1, -1>();
+            BitBoard d1r1 = b.Shifted<-1, 1>();
+            BitBoard d1l1 = b.Shifted<-1, -1>();
+            BitBoard u2r1 = b.Shifted<2, 1>();
+            BitBoard u2l1 = b.Shifted<2, -1>();
+            BitBoard d2r1 = b.Shifted<-2, 1>();
+            BitBoard d2l1 = b.Shifted<-2, -1>();
+
+            int bent_three = (b & u1r1 & u2r1).Count() + (b & u1l1 & u2l1).Count() +
+                (b & u1 & u2r1).Count() + (b & u1 & u2l1).Count();
+            int step_three = (b & u1r1 & b.Shifted<1, 2>()).Count() + (b & u1l1 & b.Shifted<1, -2>()).Count() +
+                (b & d1l1 & b.Shifted<-1, -2>()).Count() + (b & d1r1 & b.Shifted<-1, 2>()).Count();
+            int corner_three = (b & u1 & u1r1).Count() + (b & u1 & u1l1).Count() +
+                (b & d1 & d1l1).Count() + (b & d1 & d1r1).Count();
+            int gap_pair = (b & u2 & u2l1).Count() + (b & u2 & u2r1).Count() +
+                (b & d2 & d2l1).Count() + (b & d2 & d2r1).Count();
+
+            BitBoard other_pairs;
+            for (size_t other = (size_t)Block::Color1; other < LAYERS; ++other)
+            {
+                if (other != layer)
+                    other_pairs |= pairs[other];
+            }
+
+            rate += (weights.vertical_three * (b & u1 & u2).Count() +
+                weights.horizontal_three * (b & r1 & b.Shifted<0, 2>()).Count() +
+                weights.vertical_pair * (b & u1).Count() +
+                weights.vertical_split * (b & ~u1 & u2 & u3).Count() +
+                weights.bent_three * bent_three +
+                weights.over_pair * (b & u3 & other_pairs).Count() +
+                weights.over_skull * (b & u3 & skulls_up).Count() +
+                weights.step_three * step_three +
+                weights.corner_three * corner_three +
+                weights.gap_pair * gap_pair +
+                weights.horizontal_pair * (b & r1).Count()) * MUL;
+        }
+
+        return rate;
+    }
+
+    /// Simulates next move and calculates score.
+    /** First step only checks groups touching new blocks, next steps only groups touching moved blocks.
+        If chains is given, it gets number of clearing steps. */
+    int Simulate(size_t row1, size_t col1, size_t row2, size_t col2, int* chains = nullptr)
+    {
+        STATS(++s_Stats.simulations);
+
+        int score = 0;
+        int steps = 0;
+
+        int chain_power = -1;
+
+        BitBoard seeds = BitBoard::Cell(row1, col1) | BitBoard::Cell(row2, col2);
+
+        do
+        {
+            int blocks_count = 0;
+            int group_bonus = 0;
+            int colors_count = 0;
+
+            BitBoard cleared;
+
+            for (size_t layer = (size_t)Block::Color1; layer < LAYERS; ++layer)
+            {
+                BitBoard candidates = m_Layers[layer] & seeds;
+                bool color_cleared = false;
+
+                while (candidates.Any())
+                {
+                    BitBoard group = FloodFill(candidates.Lowest(), m_Layers[layer]);
+                    candidates &= ~group;
+
+                    int blocks = group.Count();
+                    if (blocks >= 4)
+                    {
+                        cleared |= group;
+                        color_cleared = true;
+
+                        blocks_count += blocks;
+                        group_bonus += GetGroupBonus(blocks);
+                    }
+                }
+
+                if (color_cleared)
+                    ++colors_count;
+            }
+
+            if (blocks_count == 0)
+                break;
+
+            cleared |= m_Layers[(size_t)Block::Skull] & cleared.Neighbours();
+
+            BitBoard remain = ~cleared;
+            for (auto& layer : m_Layers)
+                layer &= remain;
+
+            seeds = Colapse();
+
+            if (chain_power == -1)
+                chain_power = 0;
+            else if (chain_power == 0)
+                chain_power = 8;
+            else
+                chain_power *= 2;
+
+            int color_bonus = GetColorBonus(colors_count);
+
+            score += (10 * blocks_count) * max(chain_power + color_bonus + group_bonus, 1);
+            ++steps;
+
+        } while (true);
+
+        if (chains)
+            *chains = steps;
+
+        return score;
+    }
+
+    /// Drops all blocks down.
+    /** Returns mask of blocks which have moved. */
+    BitBoard Colapse()
+    {
+        BitBoard moved;
+        BitBoard occupied = GetOccupied();
+
+        for (size_t col = 0; col < COLS; ++col)
+        {
+            uint32_t column = occupied.GetColumn(col);
+            if ((column & (column + 1)) == 0)
+                continue;
+
+            for (auto& layer : m_Layers)
+                layer.SetColumn(col, CompressBits(layer.GetColumn(col), column));
+
+            uint32_t hole = CountTrailingZeros(~column);
+            uint32_t fallen = ((1u << PopCount(column)) - 1) & ~((1u << hole) - 1);
+
+            BitBoard fallen_mask;
+            fallen_mask.SetColumn(col, fallen);
+            moved |= fallen_mask;
+        }
+
+        return moved;
+    }
+
+    bool IsAtLeastFourColorBlocks(size_t row, size_t col) const
+    {
+        Block block = Get(row, col);
+        if (!IsColor(block))
+            return false;
+
+        return FloodFill(BitBoard::Cell(row, col), m_Layers[(size_t)block]).Count() >= 4;
+    }
+
+    void Read(istream& in)
+    {
+        ClearLayers();
+
+        string line;
+        for (size_t i = 0; i < ROWS; ++i)
+        {
+            in >> line; in.ignore();
+
+            ReadRow(ROWS - 1 - i, line.c_str());
+        }
+    }
+
+    /// Reads rows directly from input buffer.
+    /** Returns false at end of input. */
+    bool Read(InputReader& in)
+    {
+        ClearLayers();
+
+        for (size_t i = 0; i < ROWS; ++i)
+        {
+            const char* line = in.ReadToken(COLS);
+            if (!line)
+                return false;
+
+            ReadRow(ROWS - 1 - i, line);
+        }
+
+        return true;
+    }
+
+    void Read(string (&lines)[ROWS])
+    {
+        ClearLayers();
+
+        for (size_t i = 0; i < ROWS; ++i)
+        {
+            ReadRow(ROWS - 1 - i, lines[i].c_str());
+        }
+    }
+
+    /// Cells of grid saved to take back moves.
+    struct Undo
+    {
+        BitBoard layers[LAYERS];
+    };
+
+    /// Saves cells, so changes made later can be taken back by Restore.
+    void Save(Undo& undo) const
+    {
+        copy(begin(m_Layers), end(m_Layers), begin(undo.layers));
+    }
+
+    /// Takes back changes made after Save.
+    void Restore(const Undo& undo)
+    {
+        copy(begin(undo.layers), end(undo.layers), begin(m_Layers));
+    }
+
+    void Print(ostream& out) const
+    {
+        for (size_t i = 0; i < ROWS; ++i)
+        {
+            size_t row = ROWS - 1 - i;
+            for (size_t col = 0; col < COLS; ++col)
+                out << CharFromBlock(Get(row, col));
+
+            out << endl;
+        }
+    }
+
+private:
+    static BitBoard FloodFill(BitBoard group, const BitBoard& mask)
+    {
+        do
+        {
+            BitBoard next = (group | group.Neighbours()) & mask;
+            if (next == group)
+                return group;
+            group = next;
+        } while (true);
+    }
+
+    BitBoard GetOccupied() const
+    {
+        BitBoard occupied;
+        for (const auto& layer : m_Layers)
+            occupied |= layer;
+        return occupied;
+    }
+
+    BitBoard GetColors() const
+    {
+        BitBoard colors;
+        for (size_t layer = (size_t)Block::Color1; layer < LAYERS; ++layer)
+            colors |= m_Layers[layer];
+        return colors;
+    }
+
+    void ClearLayers()
+    {
+        for (auto& layer : m_Layers)
+            layer = BitBoard();
+    }
+
+    /// Sets cells of row, layers must be cleared before.
+    void ReadRow(size_t row, const char* line)
+    {
+        for (size_t i = 0; i < COLS; ++i)
+        {
+            Block block = BlockFromChar(line[i]);
+            if (!IsEmpty(block))
+                m_Layers[(size_t)block] |= BitBoard::Cell(row, i);
+        }
+    }
+
+    BitBoard m_Layers[LAYERS];
+};
+
+#if USE_BIT_GRID
+typedef BitGrid SearchGrid;
+#else
+typedef Grid SearchGrid;
+#endif
+
+/// Wall-clock limit for search.
+class Deadline
+{
+public:
+    typedef chrono::steady_clock Clock;
+
+    /// Creates deadline which never expires.
+    Deadline() : m_Time(Clock::time_point::max()) {}
+    /// Creates deadline which expires after budget from start.
+    Deadline(Clock::time_point start, chrono::microseconds budget) : m_Time(start + budget) {}
+
+    bool IsExpired() const
+    {
+        return m_Time != Clock::time_point::max() && Clock::now() >= m_Time;
+    }
+
+private:
+    Clock::time_point m_Time;
+};
+
+/// Fixed-size transposition table for recursive search.
+/** Entries are keyed by grid hash and depth, buckets of four entries fill one cache line.
+    Entries of previous searches are ignored, so table must be advanced with NewSearch when pieces change. */
+class TranspositionTable
+{
+public:
+    static const size_t BUCKETS = 1 << 16;
+    static const size_t BUCKET_ENTRIES = 4;
+
+    TranspositionTable() : m_Generation(0) {}
+
+    /// Invalidates all stored entries.
+    void NewSearch()
+    {
+        if (++m_Generation == 0)
+            ++m_Generation;
+    }
+
+    /// Gets key of grid before move of given depth.
+    static uint64_t GetKey(uint64_t grid_hash, int deep)
+    {
+        uint64_t state = (uint64_t)deep;
+        return grid_hash ^ SplitMix64(state);
+    }
+
+    /// Finds value of grid searched to the same remaining depth.
+    bool Probe(uint64_t key, int remaining_deep, int& value, size_t& move) const
+    {
+        const Bucket& bucket = m_Buckets[key & (BUCKETS - 1)];
+        for (const Entry& entry : bucket.entries)
+        {
+            if (entry.key == key && entry.generation == m_Generation && entry.deep == remaining_deep)
+            {
+                value = entry.value;
+                move = entry.move;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /// Stores searched value, replaces the same key, stale or the shallowest entry.
+    void Store(uint64_t key, int remaining_deep, int value, size_t move)
+    {
+        Bucket& bucket = m_Buckets[key & (BUCKETS - 1)];
+
+        Entry* replace = &bucket.entries[0];
+        for (Entry& entry : bucket.entries)
+        {
+            if (entry.key == key || entry.generation != m_Generation)
+            {
+                replace = &entry;
+                break;
+            }
+            if (entry.deep < replace->deep)
+                replace = &entry;
+        }
+
+        replace->key = key;
+        replace->value = value;
+        replace->generation = m_Generation;
+        replace->deep = (uint8_t)remaining_deep;
+        replace->move = (uint8_t)move;
+    }
+
+private:
+    struct Entry
+    {
+        uint64_t key;
+        int32_t value;
+        uint16_t generation;
+        uint8_t deep;
+        uint8_t move;
+    };
+
+    struct alignas(64) Bucket
+    {
+        Entry entries[BUCKET_ENTRIES];
+    };
+
+    static_assert(sizeof(Bucket) == 64, "Bucket should fill one cache line.");
+
+    Bucket m_Buckets[BUCKETS];
+    uint16_t m_Generation;
+};
+
+/// Chains and scores started by single block of every color dropped to every column.
+template <class GRID>
+struct ChainPotential
+{
+    static const size_t COLORS = (size_t)Block::Count - (size_t)Block::Color1;
+
+    uint8_t chains[COLORS][GRID::COLS];
+    int scores[COLORS][GRID::COLS];
+    int best_chains;
+    int best_score;
+};
+
+/// Analyzes which chains are waiting for one trigger block.
+/** Colors with less than 3 blocks cannot make group with one more block and are skipped. */
+template <class GRID>
+void AnalyzeChainPotential(const GRID& grid, ChainPotential<GRID>& potential)
+{
+    typedef ChainPotential<GRID> Potential;
+
+    potential.best_chains = 0;
+    potential.best_score = 0;
+
+    for (size_t color = 0; color < Potential::COLORS; ++color)
+    {
+        Block block = (Block)((size_t)Block::Color1 + color);
+        bool enough = grid.CalculateBlocksNumber(block) >= 3;
+
+        for (size_t col = 0; col < GRID::COLS; ++col)
+        {
+            int chains = 0;
+            int score = 0;
+
+            if (enough)
+            {
+                GRID calc_grid = grid;
+                size_t row = calc_grid.AddBlock(col, block);
+                if (row < GRID::ROWS)
+                    score = calc_grid.Simulate(row, col, row, col, &chains);
+            }
+
+            potential.chains[color][col] = (uint8_t)chains;
+            potential.scores[color][col] = score;
+            potential.best_chains = max(potential.best_chains, chains);
+            potential.best_score = max(potential.best_score, score);
+        }
+    }
+}
+
+/// Direct-mapped cache of chain potentials keyed by grid hash.
+template <class GRID>
+class ChainPotentialCache
+{
+public:
+    static const size_t ENTRIES = 1 << 12;
+
+    ChainPotentialCache()
+    {
+        for (Entry& entry : m_Entries)
+            entry.valid = false;
+    }
+
+    /// Gets potential of grid, analyzes grid if it is not cached.
+    const ChainPotential<GRID>& Get(const GRID& grid)
+    {
+        uint64_t hash = grid.GetHash();
+        Entry& entry = m_Entries[hash & (ENTRIES - 1)];
+        if (!entry.valid || entry.hash != hash)
+        {
+            AnalyzeChainPotential(grid, entry.potential);
+            entry.hash = hash;
+            entry.valid = true;
+        }
+
+        return entry.potential;
+    }
+
+private:
+    struct Entry
+    {
+        uint64_t hash;
+        bool valid;
+        ChainPotential<GRID> potential;
+    };
+
+    Entry m_Entries[ENTRIES];
+};
+
+/// Rates the longest chain waiting for one trigger block, in units of grid rate.
+/** Returns 0 without analysis when chain_potential weight is off. */
+template <class GRID>
+int CalculateChainRate(const GRID& grid)
+{
+    const Weights& weights = GetWeights();
+    if (weights.chain_potential == 0)
+        return 0;
+
+    // Each search thread has own cache.
+    static thread_local ChainPotentialCache<GRID> cache;
+
+    const int MUL = GRID::ROWS * GRID::ROWS;
+    return cache.Get(grid).best_chains * weights.chain_potential * MUL;
+}
+
+/// Combines grid rate and move score into single move value.
+/** Later scores get bonus for building up bigger combos. */
+inline int CalculateMoveValue(int rate, int score, int deep, int deep_bonus)
+{
+    return rate + (score + (score ? (/*MOVES - */deep) * max(deep_bonus, 0) : 0)) * numeric_limits<short>::max();
+}
+
+/// Columns taken by pair dropped with one of moves col * ROTS + rot.
+/** Pair at rot 0 lies to the right of col, at rot 2 to the left. Block of col1 lands first,
+    so it is the lower one when both blocks share column. */
+struct Placement
+{
+    uint8_t move;
+    uint8_t col1;
+    uint8_t col2;
+    /// col1 gets colorB instead of colorA.
+    bool swapped;
+};
+
+/// All legal placements in move order, moves with pair sticking out of grid are left out.
+static constexpr Placement PLACEMENTS[] = {
+    { 0, 0, 1, false }, { 1, 0, 0, false }, { 3, 0, 0, true },
+    { 4, 1, 2, false }, { 5, 1, 1, false }, { 6, 0, 1, true }, { 7, 1, 1, true },
+    { 8, 2, 3, false }, { 9, 2, 2, false }, { 10, 1, 2, true }, { 11, 2, 2, true },
+    { 12, 3, 4, false }, { 13, 3, 3, false }, { 14, 2, 3, true }, { 15, 3, 3, true },
+    { 16, 4, 5, false }, { 17, 4, 4, false }, { 18, 3, 4, true }, { 19, 4, 4, true },
+    { 21, 5, 5, false }, { 22, 4, 5, true }, { 23, 5, 5, true },
+};
+
+static_assert(countof(PLACEMENTS) == 22, "Pair has 22 legal placements on 6 columns.");
+
+/// Gets placement of move or nullptr if pair would stick out of grid.
+inline const Placement* GetPlacement(size_t col, size_t rot)
+{
+    for (const Placement& placement : PLACEMENTS)
+    {
+        if (placement.move == col * ROTS + rot)
+            return &placement;
+    }
+
+    return nullptr;
+}
+
+/// Drops full rows of skulls on grid, skulls which do not fit are lost.
+template <class GRID>
+void AddSkullRows(GRID& grid, int rows)
+{
+    for (int row = 0; row < rows; ++row)
+        for (size_t col = 0; col < GRID::COLS; ++col)
+            grid.AddBlock(col, Block::Skull);
+}
+
+template <class GRID>
+pair<int, int> CalculateMove(const GRID& grid, const Placement& placement, Block(&colorsA)[MOVES], Block(&colorsB)[MOVES], const int (&skull_rows)[MOVES], int deep, int max_deep, int deep_bonus, const Deadline& deadline, TranspositionTable* transpositions);
+
+/// Drops pair on grid, grid is not changed if pair does not fit.
+template <class GRID>
+inline bool AddBlocksToGrid(GRID& calc_grid, const Placement& placement, Block colorA, Block colorB, size_t& row1, size_t& col1, size_t& row2, size_t& col2)
+{
+    col1 = placement.col1;
+    col2 = placement.col2;
+
+    if (placement.swapped)
+        return calc_grid.AddBlocks(col1, colorB, col2, colorA, row1, row2);
+    else
+        return calc_grid.AddBlocks(col1, colorA, col2, colorB, row1, row2);
+}
+
+template <class GRID>
+inline bool AddBlocksToGrid(GRID& calc_grid, const Placement& placement, Block(&colorsA)[MOVES], Block(&colorsB)[MOVES], int deep, size_t& row1, size_t& col1, size_t& row2, size_t& col2)
+{
+    return AddBlocksToGrid(calc_grid, placement, colorsA[deep], colorsB[deep], row1, col1, row2, col2);
+}
+
+template <class GRID>
+inline bool AddBlocksToGrid(GRID& calc_grid, size_t col, size_t rot, Block(&colorsA)[MOVES], Block(&colorsB)[MOVES], int deep, size_t& row1, size_t& col1, size_t& row2, size_t& col2)
+{
+    const Placement* placement = GetPlacement(col, rot);
+
+    return placement && AddBlocksToGrid(calc_grid, *placement, colorsA, colorsB, deep, row1, col1, row2, col2);
+}
+
+/// Child of search node with value of its own move.
+template <class GRID>
+struct SearchChild
+{
+    GRID grid;
+    int value;
+    int score;
+    size_t move;
+};
+
+/// Preallocated children of every search depth.
+/** Node of given depth expands its children into slots of that depth, so every ply copies grids
+    into the same memory and going back up is just lower depth. */
+template <class GRID>
+struct SearchStack
+{
+    SearchChild<GRID> children[MOVES][countof(PLACEMENTS)];
+};
+
+/// Rates grid with pair just dropped, simulates pair and adds rate of chains waiting in settled grid.
+/** Returns rate in units of move value. */
+template <class GRID>
+int SimulateAndRate(GRID& grid, size_t row1, size_t col1, size_t row2, size_t col2, int& score)
+{
+    int rate;
+    {
+        STATS(StatsTimer timer(s_Stats.rate_time));
+        rate = grid.CalculateRate();
+    }
+
+    {
+        STATS(StatsTimer timer(s_Stats.simulate_time));
+#if SEARCH_STATS
+        int chains;
+        score = grid.Simulate(row1, col1, row2, col2, &chains);
+        s_Stats.AddChains(chains);
+#else
+        score = grid.Simulate(row1, col1, row2, col2);
+#endif
+    }
+
+    STATS(StatsTimer timer(s_Stats.rate_time));
+    return (rate + CalculateChainRate(grid)) / 1000;
+}
+
+/// Drops pair on copy of grid, simulates it and rates move.
+/** Returns false if pair does not fit. */
+template <class GRID>
+bool ExpandMove(const GRID& grid, const Placement& placement, Block colorA, Block colorB, int deep, int deep_bonus, SearchChild<GRID>& child)
+{
+    child.grid = grid;
+    child.move = placement.move;
+
+    size_t row1, col1, row2, col2;
+    if (!AddBlocksToGrid(child.grid, placement, colorA, colorB, row1, col1, row2, col2))
+        return false;
+
+    STATS(++s_Stats.nodes[deep]);
+    int rate = SimulateAndRate(child.grid, row1, col1, row2, col2, child.score);
+
+    //assert(rate < numeric_limits<short>::max());
+    //assert(rate >= 0);
+    child.value = CalculateMoveValue(rate, child.score, deep, deep_bonus);
+    return true;
+}
+
+/// Checks if placement gives the same grid as earlier one in move order.
+/** Pair of one color is symmetric, so swapped placements repeat not swapped ones with lower move. */
+inline bool IsRepeatedPlacement(const Placement& placement, Block colorA, Block colorB)
+{
+    return placement.swapped && colorA == colorB;
+}
+
+/// Checks if any color has enough blocks on grid and in pieces of plies first_deep to last_deep to make group of 4.
+/** If not, no move of these plies can score. */
+template <class GRID>
+bool CanScore(const GRID& grid, Block(&colorsA)[MOVES], Block(&colorsB)[MOVES], int first_deep, int last_deep)
+{
+    size_t counts[(size_t)Block::Count] = { 0 };
+    for (int deep = first_deep; deep <= last_deep; ++deep)
+    {
+        ++counts[(size_t)colorsA[deep]];
+        ++counts[(size_t)colorsB[deep]];
+    }
+
+    for (size_t color = (size_t)Block::Color1; color < (size_t)Block::Count; ++color)
+    {
+        if (counts[color] + grid.CalculateBlocksNumber((Block)color) >= 4)
+            return true;
+    }
+
+    return false;
+}
+
+/// Calculates upper bound of rate part of move value, as if every pattern matched at every cell.
+template <class GRID>
+int CalculateMaxMoveRate()
+{
+    const Weights& weights = GetWeights();
+    const int MUL = GRID::ROWS * GRID::ROWS;
+
+    int height_rate = (int)GRID::ROWS * 4 * 4 * weights.height_diff;
+    int color_rate = weights.inner_column + weights.vertical_pair + weights.vertical_three + weights.horizontal_three +
+        weights.vertical_split + weights.over_pair + weights.over_skull + weights.horizontal_pair +
+        4 * (weights.bent_three + weights.step_three + weights.corner_three + weights.gap_pair);
+    int cell_rate = max(4 * weights.skull_color, color_rate);
+    // Every step of chain clears at least 4 blocks.
+    int chain_rate = (int)(GRID::ROWS * GRID::COLS / 4) * weights.chain_potential;
+
+    return (height_rate + (int)(GRID::ROWS * GRID::COLS) * cell_rate + chain_rate) * MUL / 1000 + 1;
+}
+
+/// Finds value of the best line of moves from grid.
+/** Children are searched in order of their own move values. Child is skipped when none of its lines can score
+    and even the best rate at every later ply would not reach value of the best child so far, so pruning
+    never changes result. Pairs of one color skip repeated placements. */
+template <class GRID>
+int CalculateBestMove(const GRID& grid, Block(&colorsA)[MOVES], Block(&colorsB)[MOVES], const int (&skull_rows)[MOVES], int deep, int max_deep, int deep_bonus, const Deadline& deadline, TranspositionTable* transpositions)
+{
+    uint64_t key = 0;
+    if (transpositions)
+    {
+        key = TranspositionTable::GetKey(grid.GetHash(), deep);
+
+        int value;
+        size_t move;
+        if (transpositions->Probe(key, max_deep - deep, value, move))
+            return value;
+    }
+
+    // Each search thread has own stack.
+    static thread_local SearchStack<GRID> stack;
+    SearchChild<GRID>* children = stack.children[deep];
+    size_t order[countof(PLACEMENTS)];
+    size_t count = 0;
+
+    for (const Placement& placement : PLACEMENTS)
+    {
+        if (IsRepeatedPlacement(placement, colorsA[deep], colorsB[deep]))
+            continue;
+
+        if (ExpandMove(grid, placement, colorsA[deep], colorsB[deep], deep, deep_bonus, children[count]))
+        {
+            order[count] = count;
+            ++count;
+        }
+    }
+
+    int64_t max_future_rate = 0;
+    if (deep < max_deep)
+    {
+        sort(order, order + count, [&](size_t a, size_t b)
+        {
+            return children[a].value > children[b].value || (children[a].value == children[b].value && a < b);
+        });
+
+        max_future_rate = (int64_t)(max_deep - deep) * CalculateMaxMoveRate<GRID>();
+    }
+
+    int best_val = numeric_limits<int>::min();
+    size_t best_move = 0;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        SearchChild<GRID>& child = children[order[i]];
+
+        int val = child.value;
+
+        if (deep < max_deep && !deadline.IsExpired())
+        {
+            if (child.value + max_future_rate < best_val && !CanScore(child.grid, colorsA, colorsB, deep + 1, max_deep))
+                continue;
+
+            AddSkullRows(child.grid, skull_rows[deep + 1]);
+
+            int child_best_val = CalculateBestMove(child.grid, colorsA, colorsB, skull_rows, deep + 1, max_deep, deep_bonus, deadline, transpositions);
+            if (child_best_val > numeric_limits<int>::min())
+                val += child_best_val;
+        }
+
+        if (val > best_val || (val == best_val && child.move < best_move))
+        {
+            best_val = val;
+            best_move = child.move;
+        }
+    }
+
+    if (transpositions && !deadline.IsExpired())
+        transpositions->Store(key, max_deep - deep, best_val, best_move);
+
+    return best_val;
+}
+
+template <class GRID>
+pair<int, int> CalculateMove(const GRID& grid, const Placement& placement, Block(&colorsA)[MOVES], Block(&colorsB)[MOVES], const int (&skull_rows)[MOVES], int deep, int max_deep, int deep_bonus, const Deadline& deadline, TranspositionTable* transpositions)
+{
+    SearchChild<GRID> child;
+    if (!ExpandMove(grid, placement, colorsA[deep], colorsB[deep], deep, deep_bonus, child))
+        return make_pair(numeric_limits<int>::min(), numeric_limits<int>::min());
+
+    int val = child.value;
+
+    if (deep < max_deep && !deadline.IsExpired())
+    {
+        AddSkullRows(child.grid, skull_rows[deep + 1]);
+
+        int best_val = CalculateBestMove(child.grid, colorsA, colorsB, skull_rows, deep + 1, max_deep, deep_bonus, deadline, transpositions);
+        if (best_val > numeric_limits<int>::min())
+        {
+            //best_val /= numeric_limits<short>::max();
+            //best_val *= numeric_limits<short>::max();
+
+            val += best_val;
+        }
+        //else
+        //    val = best_val;
+    }
+
+    return make_pair(val, child.score);
+}
+
+/// Finds move which should be played now because of its immediate score.
+/** Big combos are fired at once, smaller ones when the opponent is about to attack. */
+template <size_t N>
+bool FindComboMove(const int (&scores)[N], int deep_bonus, int other_max_score, size_t& idx)
+{
+    auto max_score_it = max_element(begin(scores), end(scores));
+    int max_score = *max_score_it;
+    idx = distance(begin(scores), max_score_it);
+
+    const Weights& weights = GetWeights();
+
+    if (max_score >= 6 * 70 * max(weights.combo_rows + deep_bonus * weights.combo_bonus_rows, 1))
+        return true;
+
+    if (max_score >= 6 * 70 * weights.answer_rows_1 && other_max_score >= 6 * 70 * weights.answer_threat_rows_1)
+        return true;
+    if (max_score >= 6 * 70 * weights.answer_rows_2 && other_max_score >= 6 * 70 * weights.answer_threat_rows_2)
+        return true;
+    if (max_score >= 6 * 70 * weights.answer_rows_3 && other_max_score >= 6 * 70 * weights.answer_threat_rows_3)
+        return true;
+
+    return false;
+}
+
+/// Chooses root move from values and immediate scores of all root moves.
+template <size_t N>
+size_t ChooseBestMove(const int (&values)[N], const int (&scores)[N], int deep_bonus, int other_max_score)
+{
+    size_t combo_idx;
+    if (FindComboMove(scores, deep_bonus, other_max_score, combo_idx))
+        return combo_idx;
+
+    auto max_it = max_element(begin(values), end(values));
+    size_t max_idx = distance(begin(values), max_it);
+
+    return max_idx;
+}
+
+template <class GRID>
+size_t FindBestMove(const GRID& grid, Block (&colorsA)[MOVES], Block(&colorsB)[MOVES], const int (&skull_rows)[MOVES], int max_deep, int deep_bonus, int other_max_score, const Deadline& deadline, TranspositionTable* transpositions)
+{
+    int values[GRID::COLS * ROTS];
+    int scores[GRID::COLS * ROTS];
+    fill(begin(values), end(values), numeric_limits<int>::min());
+    fill(begin(scores), end(scores), numeric_limits<int>::min());
+
+    for (const Placement& placement : PLACEMENTS)
+    {
+        if (IsRepeatedPlacement(placement, colorsA[0], colorsB[0]))
+            continue;
+
+        auto val_score = CalculateMove(grid, placement, colorsA, colorsB, skull_rows, 0, max_deep, deep_bonus, deadline, transpositions);
+        values[placement.move] = val_score.first;
+        scores[placement.move] = val_score.second;
     }
-    else if (rot == 1)
+
+    return ChooseBestMove(values, scores, deep_bonus, other_max_score);
+}
+
+#if PARALLEL_SEARCH
+/// Root-split version of FindBestMove for offline analysis and self-play.
+/** Root moves are shared out to worker threads, each with its own grid copy and transposition table.
+    Root values do not depend on the worker which searched them, so result is the same as FindBestMove.
+    Not reentrant, worker tables are shared between calls. */
+template <class GRID>
+size_t FindBestMoveParallel(const GRID& grid, Block(&colorsA)[MOVES], Block(&colorsB)[MOVES], const int (&skull_rows)[MOVES], int max_deep, int deep_bonus, int other_max_score, const Deadline& deadline, size_t threads)
+{
+    static const size_t MAX_THREADS = 8;
+    static const size_t ROOT_MOVES = GRID::COLS * ROTS;
+    static TranspositionTable worker_transpositions[MAX_THREADS];
+
+    if (threads == 0)
+        threads = thread::hardware_concurrency();
+    threads = max<size_t>(1, min(threads, MAX_THREADS));
+
+    int values[ROOT_MOVES];
+    int scores[ROOT_MOVES];
+    fill(begin(values), end(values), numeric_limits<int>::min());
+    fill(begin(scores), end(scores), numeric_limits<int>::min());
+    atomic<size_t> next_idx(0);
+
+    auto worker = [&](size_t worker_idx)
+    {
+        GRID worker_grid = grid;
+        TranspositionTable& transpositions = worker_transpositions[worker_idx];
+        transpositions.NewSearch();
+
+        for (size_t idx = next_idx++; idx < countof(PLACEMENTS); idx = next_idx++)
+        {
+            const Placement& placement = PLACEMENTS[idx];
+            if (IsRepeatedPlacement(placement, colorsA[0], colorsB[0]))
+                continue;
+
+            auto val_score = CalculateMove(worker_grid, placement, colorsA, colorsB, skull_rows, 0, max_deep, deep_bonus, deadline, &transpositions);
+            values[placement.move] = val_score.first;
+            scores[placement.move] = val_score.second;
+        }
+    };
+
+    vector<thread> workers;
+    for (size_t worker_idx = 1; worker_idx < threads; ++worker_idx)
+        workers.emplace_back(worker, worker_idx);
+
+    worker(0);
+
+    for (auto& w : workers)
+        w.join();
+
+    return ChooseBestMove(values, scores, deep_bonus, other_max_score);
+}
+#endif
+
+#if SEARCH_STATS
+/// Follows best moves stored in transposition table from root move and records them as principal variation.
+template <class GRID>
+void RecordPrincipalVariation(const GRID& grid, Block(&colorsA)[MOVES], Block(&colorsB)[MOVES], const int (&skull_rows)[MOVES], int max_deep, size_t move, const TranspositionTable& transpositions)
+{
+    GRID calc_grid = grid;
+    s_Stats.line_length = 0;
+
+    for (int deep = 0; deep <= max_deep; ++deep)
     {
-        col1 = col;
-        col2 = col;
-        row1 = calc_grid.AddBlock(col, colorsA[deep]);
-        row2 = calc_grid.AddBlock(col, colorsB[deep]);
+        s_Stats.line[s_Stats.line_length++] = (uint8_t)move;
+
+        size_t row1, col1, row2, col2;
+        if (deep == max_deep || !AddBlocksToGrid(calc_grid, move / ROTS, move % ROTS, colorsA, colorsB, deep, row1, col1, row2, col2))
+            break;
+
+        calc_grid.Simulate(row1, col1, row2, col2);
+        AddSkullRows(calc_grid, skull_rows[deep + 1]);
+
+        int value;
+        if (!transpositions.Probe(TranspositionTable::GetKey(calc_grid.GetHash(), deep + 1), max_deep - deep - 1, value, move))
+            break;
     }
-    else if (rot == 2)
+}
+#endif
+
+/// Anytime search, deepens one ply at a time until max_deep or deadline.
+/** Returns move of the last completed depth, depth 0 is always completed.
+    Deeper iterations are split between threads when PARALLEL_SEARCH is enabled and threads is not 1. */
+template <class GRID>
+size_t FindBestMoveIterative(const GRID& grid, Block(&colorsA)[MOVES], Block(&colorsB)[MOVES], const int (&skull_rows)[MOVES], int max_deep, int deep_bonus, int other_max_score, const Deadline& deadline, TranspositionTable* transpositions, size_t threads = 1)
+{
+    if (transpositions)
+        transpositions->NewSearch();
+
+    size_t best_idx = FindBestMove(grid, colorsA, colorsB, skull_rows, 0, deep_bonus, other_max_score, Deadline(), transpositions);
+    int completed_deep = 0;
+
+    for (int deep = 1; deep <= max_deep; ++deep)
     {
-        col1 = col - 1;
-        col2 = col;
-        row1 = calc_grid.AddBlock(col - 1, colorsB[deep]);
-        row2 = calc_grid.AddBlock(col, colorsA[deep]);
+#if PARALLEL_SEARCH
+        size_t idx = threads != 1 ?
+            FindBestMoveParallel(grid, colorsA, colorsB, skull_rows, deep, deep_bonus, other_max_score, deadline, threads) :
+            FindBestMove(grid, colorsA, colorsB, skull_rows, deep, deep_bonus, other_max_score, deadline, transpositions);
+#else
+        (void)threads;
+        size_t idx = FindBestMove(grid, colorsA, colorsB, skull_rows, deep, deep_bonus, other_max_score, deadline, transpositions);
+#endif
+        if (deadline.IsExpired())
+            break;
+
+        best_idx = idx;
+        completed_deep = deep;
     }
-    else //if (rot == 3)
+
+#if SEARCH_STATS
+    if (transpositions)
+        RecordPrincipalVariation(grid, colorsA, colorsB, skull_rows, completed_deep, best_idx, *transpositions);
+#else
+    (void)completed_deep;
+#endif
+
+    return best_idx;
+}
+
+/// Node of beam search.
+template <class GRID>
+struct BeamNode
+{
+    GRID grid;
+    int64_t value;
+    int score;
+    size_t move;
+    /// Move of second ply, value of first one and number of later scoring plies, so line can be carried to next turn.
+    size_t next_move;
+    int64_t root_value;
+    int scoring_plies;
+    bool next_scored;
+#if SEARCH_STATS
+    uint8_t line[MOVES];
+#endif
+};
+
+/// Lines of beam search carried over to next turn.
+/** Keeps the last completed beam level under played move, moved one ply up. Next turn merges them into
+    its level of the same depth, if real grid matches predicted grid and pieces are shifted by one pair.
+    Values of carried lines are moved one ply up too, but keep skull rows and pieces of turn they were found in. */
+template <class GRID>
+struct BeamCarry
+{
+    BeamCarry() : deep(-1) {}
+
+    vector<BeamNode<GRID>> nodes;
+    GRID predicted;
+    Block colorsA[MOVES];
+    Block colorsB[MOVES];
+    /// Level of next turn search which nodes belong to, -1 if nothing is carried.
+    int deep;
+};
+
+/// Checks if carried lines start from given grid and pieces.
+template <class GRID>
+bool MatchBeamCarry(const BeamCarry<GRID>& carry, const GRID& grid, Block(&colorsA)[MOVES], Block(&colorsB)[MOVES])
+{
+    if (carry.deep < 0)
+        return false;
+
+    for (size_t i = 0; i + 1 < MOVES; ++i)
     {
-        col1 = col;
-        col2 = col;
-        row1 = calc_grid.AddBlock(col, colorsB[deep]);
-        row2 = calc_grid.AddBlock(col, colorsA[deep]);
+        if (colorsA[i] != carry.colorsA[i + 1] || colorsB[i] != carry.colorsB[i + 1])
+            return false;
     }
 
-    return row1 != (size_t)-1 && row2 != (size_t)-1;
+    return grid == carry.predicted;
 }
 
-pair<int, int> CalculateMove(const Grid& grid, size_t col, size_t rot, Block(&colorsA)[MOVES], Block(&colorsB)[MOVES], int deep, int max_deep, int deep_bonus)
+/// Adds carried lines which are not in beam level already.
+template <class GRID>
+void MergeBeamCarry(const BeamCarry<GRID>& carry, vector<BeamNode<GRID>>& level)
 {
-    Grid calc_grid = grid;
+    static vector<uint64_t> hashes;
+    hashes.clear();
+    for (const BeamNode<GRID>& node : level)
+        hashes.push_back(node.grid.GetHash());
+    sort(hashes.begin(), hashes.end());
 
-    int val = numeric_limits<int>::min();
+    for (const BeamNode<GRID>& node : carry.nodes)
+    {
+        if (!binary_search(hashes.begin(), hashes.end(), node.grid.GetHash()))
+            level.push_back(node);
+    }
+}
+
+/// Keeps lines of beam starting with move for next turn.
+template <class GRID>
+void SaveBeamCarry(BeamCarry<GRID>& carry, const vector<BeamNode<GRID>>& beam, int deep, const GRID& grid, Block(&colorsA)[MOVES], Block(&colorsB)[MOVES], size_t move, int deep_bonus)
+{
+    carry.deep = -1;
+    carry.nodes.clear();
 
+    // Lines of one or two plies give nothing the next search would not find at once.
+    if (deep < 2)
+        return;
+
+    carry.predicted = grid;
     size_t row1, col1, row2, col2;
-    bool added = AddBlocksToGrid(calc_grid, col, rot, colorsA, colorsB, deep, row1, col1, row2, col2);
+    if (!AddBlocksToGrid(carry.predicted, move / ROTS, move % ROTS, colorsA, colorsB, 0, row1, col1, row2, col2))
+        return;
+    carry.predicted.Simulate(row1, col1, row2, col2);
 
-    int score = numeric_limits<int>::min();
+    for (const BeamNode<GRID>& node : beam)
+    {
+        if (node.move != move)
+            continue;
+
+        carry.nodes.push_back(node);
+        BeamNode<GRID>& carried = carry.nodes.back();
+        carried.move = node.next_move;
+        STATS(copy(node.line + 1, node.line + MOVES, carried.line));
+        // Every scoring ply loses one deep of bonus, see CalculateMoveValue.
+        carried.value = node.value - node.root_value - (int64_t)node.scoring_plies * max(deep_bonus, 0) * numeric_limits<short>::max();
+        carried.scoring_plies = node.scoring_plies - (node.next_scored ? 1 : 0);
+    }
 
-    if (added)
+    copy(begin(colorsA), end(colorsA), begin(carry.colorsA));
+    copy(begin(colorsB), end(colorsB), begin(carry.colorsB));
+    carry.deep = deep - 1;
+}
+
+/// Beam search over known pieces.
+/** Expands all moves of the best beam_width grids at each depth and keeps the best beam_width children,
+    ranked by summed move values (grid rate plus score) along their path. Searches up to max_deep or deadline.
+    Returns first move of the best line of the last completed depth, depth 0 is always completed.
+    If carry is given, lines of previous turn are merged in and lines under returned move are kept for next turn. */
+template <class GRID>
+size_t FindBestMoveBeam(const GRID& grid, Block(&colorsA)[MOVES], Block(&colorsB)[MOVES], const int (&skull_rows)[MOVES], int max_deep, size_t beam_width, int deep_bonus, int other_max_score, const Deadline& deadline, BeamCarry<GRID>* carry)
+{
+    typedef BeamNode<GRID> Node;
+
+    static vector<Node> beam;
+    static vector<Node> next_beam;
+    beam.reserve(beam_width * countof(PLACEMENTS));
+    next_beam.reserve(beam_width * countof(PLACEMENTS));
+
+    beam.clear();
+    Node root;
+    root.grid = grid;
+    root.value = 0;
+    root.score = 0;
+    root.move = 0;
+    root.next_move = 0;
+    root.root_value = 0;
+    root.scoring_plies = 0;
+    root.next_scored = false;
+    STATS(fill(begin(root.line), end(root.line), 0));
+    beam.push_back(root);
+
+    int carry_deep = -1;
+    if (carry && MatchBeamCarry(*carry, grid, colorsA, colorsB))
+        carry_deep = carry->deep;
+
+    int scores[GRID::COLS * ROTS] = { 0 };
+    size_t best_idx = 0;
+    int completed_deep = -1;
+
+    auto finish = [&](size_t idx)
     {
-        int rate = calc_grid.CalculateRate() / 1000;
+#if SEARCH_STATS
+        if (completed_deep >= 0)
+        {
+            const Node& best = *max_element(beam.begin(), beam.end(), [](const Node& a, const Node& b) { return a.value < b.value; });
+            copy(best.line, best.line + completed_deep + 1, s_Stats.line);
+            s_Stats.line_length = completed_deep + 1;
+        }
+#endif
+        if (carry)
+            SaveBeamCarry(*carry, beam, completed_deep, grid, colorsA, colorsB, idx, deep_bonus);
+        return idx;
+    };
 
-        //assert(rate < numeric_limits<short>::max());
-        //assert(rate >= 0);
-        score = calc_grid.Simulate(row1, col1, row2, col2);
-        val = rate + (score + (score ? (/*MOVES - */deep) * max(deep_bonus, 0) : 0)) * numeric_limits<short>::max();
+    for (int deep = 0; deep <= max_deep && deep < (int)MOVES; ++deep)
+    {
+        next_beam.clear();
 
-        if (deep < max_deep)//MOVES)
+        for (Node& node : beam)
         {
-            int best_val = CalculateBestMove(calc_grid, colorsA, colorsB, deep + 1, max_deep, deep_bonus);
-            if (best_val > numeric_limits<int>::min())
+            AddSkullRows(node.grid, skull_rows[deep]);
+
+            for (const Placement& placement : PLACEMENTS)
             {
-                //best_val /= numeric_limits<short>::max();
-                //best_val *= numeric_limits<short>::max();
+                next_beam.push_back(node);
+                Node& child = next_beam.back();
+
+                size_t row1, col1, row2, col2;
+                if (!AddBlocksToGrid(child.grid, placement, colorsA, colorsB, deep, row1, col1, row2, col2))
+                {
+                    next_beam.pop_back();
+                    continue;
+                }
+
+                STATS(++s_Stats.nodes[deep]);
+                STATS(child.line[deep] = (uint8_t)placement.move);
+                int rate = SimulateAndRate(child.grid, row1, col1, row2, col2, child.score);
+                child.value += CalculateMoveValue(rate, child.score, deep, deep_bonus);
+                if (deep == 0)
+                {
+                    child.move = placement.move;
+                    child.root_value = child.value;
+                }
+                else
+                {
+                    if (deep == 1)
+                    {
+                        child.next_move = placement.move;
+                        child.next_scored = child.score != 0;
+                    }
+                    if (child.score)
+                        ++child.scoring_plies;
+                }
+            }
+
+            if (deep > 0 && deadline.IsExpired())
+                return finish(best_idx);
+        }
+
+        if (deep == carry_deep)
+            MergeBeamCarry(*carry, next_beam);
 
-                val += best_val;
+        if (next_beam.empty())
+            break;
+
+        if (deep == 0)
+        {
+            for (const Node& node : next_beam)
+                scores[node.move] = node.score;
+
+            size_t combo_idx;
+            if (FindComboMove(scores, deep_bonus, other_max_score, combo_idx))
+            {
+                if (carry)
+                    carry->deep = -1;
+                return combo_idx;
             }
-            //else
-            //    val = best_val;
         }
+
+        auto by_value = [](const Node& a, const Node& b) { return a.value > b.value; };
+        if (next_beam.size() > beam_width)
+        {
+            nth_element(next_beam.begin(), next_beam.begin() + beam_width, next_beam.end(), by_value);
+            next_beam.resize(beam_width);
+        }
+
+        best_idx = min_element(next_beam.begin(), next_beam.end(), by_value)->move;
+
+        beam.swap(next_beam);
+        completed_deep = deep;
     }
 
-    return make_pair(val, score);
+    return finish(best_idx);
 }
 
-size_t FindBestMove(const Grid& grid, Block (&colorsA)[MOVES], Block(&colorsB)[MOVES], int max_deep, int deep_bonus, int other_max_score)
+/// Plays pair at place with the best immediate move value.
+/** Returns move score or -1 if pair does not fit anywhere, rate gets rate of grid after move. */
+template <class GRID>
+int PlayGreedyMove(GRID& grid, Block colorA, Block colorB, int& rate)
 {
-    int values[Grid::COLS * ROTS] = { 0 };
-    int scores[Grid::COLS * ROTS] = { 0 };
+    GRID best_grid;
+    int best_val = numeric_limits<int>::min();
+    int best_score = -1;
+    int best_rate = 0;
 
-    for (size_t col = 0; col < Grid::COLS; ++col)
+    for (const Placement& placement : PLACEMENTS)
     {
-        for (size_t rot = 0; rot < ROTS; ++rot)
+        GRID calc_grid = grid;
+
+        size_t row1, col1, row2, col2;
+        if (!AddBlocksToGrid(calc_grid, placement, colorA, colorB, row1, col1, row2, col2))
+            continue;
+
+        int score;
+        int calc_rate = SimulateAndRate(calc_grid, row1, col1, row2, col2, score);
+        int val = CalculateMoveValue(calc_rate, score, 0, 0);
+        if (val > best_val)
         {
-            auto val_score = CalculateMove(grid, col, rot, colorsA, colorsB, 0, max_deep, deep_bonus);
-            values[col * ROTS + rot] = val_score.first;
-            scores[col * ROTS + rot] = val_score.second;
+            best_val = val;
+            best_score = score;
+            best_rate = calc_rate;
+            best_grid = calc_grid;
         }
     }
 
-    auto max_score_it = max_element(begin(scores), end(scores));
-    int max_score = *max_score_it;
-    if (max_score >= 6 * 70 * max(2 + deep_bonus * 2, 1))
-        return distance(begin(scores), max_score_it);
+    if (best_score >= 0)
+    {
+        grid = best_grid;
+        rate = best_rate;
+    }
 
-    if (max_score >= 6 * 70 * 3 && other_max_score >= 6 * 70 * 1)
-        return distance(begin(scores), max_score_it);
-    if (max_score >= 6 * 70 * 2 && other_max_score >= 6 * 70 * 3)
-        return distance(begin(scores), max_score_it);
-    if (max_score >= 6 * 70 * 1 && other_max_score >= 6 * 70 * 6)
-        return distance(begin(scores), max_score_it);
+    return best_score;
+}
 
-    auto max_it = max_element(begin(values), end(values));
-    size_t max_idx = distance(begin(values), max_it);
+/// Monte Carlo search beyond known pieces.
+/** Every root move is followed by greedy moves with the rest of known pieces, then each rollout adds
+    MONTE_CARLO_MOVES random pairs played greedily. Rollouts are spread evenly over root moves until
+    max_rollouts per move or deadline. Root moves are rated by summed scores of known pieces with average
+    move value of rollouts, which includes rate of grid at rollout end, so chains built beyond known
+    pieces count. Rollout which tops out loses MONTE_CARLO_DEATH_SCORE instead of rate.
+    If every root move dies within known pieces, move which fits and survives the most pieces is taken. */
+template <class GRID>
+size_t FindBestMoveMonteCarlo(const GRID& grid, Block(&colorsA)[MOVES], Block(&colorsB)[MOVES], const int (&skull_rows)[MOVES], int deep_bonus, int other_max_score, size_t max_rollouts, const Deadline& deadline)
+{
+    static const size_t ROOT_MOVES = GRID::COLS * ROTS;
 
-    return max_idx;
+    GRID known_grids[ROOT_MOVES];
+    int known_scores[ROOT_MOVES] = { 0 };
+    int known_rates[ROOT_MOVES] = { 0 };
+    int64_t rollout_values[ROOT_MOVES] = { 0 };
+    bool valid[ROOT_MOVES] = { false };
+    int scores[ROOT_MOVES] = { 0 };
+
+    // Fallback when no root move survives all known pieces.
+    size_t survivor_idx = 0;
+    size_t survivor_plies = 0;
+
+    for (const Placement& placement : PLACEMENTS)
+    {
+        size_t idx = placement.move;
+        GRID& known_grid = known_grids[idx];
+        known_grid = grid;
+
+        size_t row1, col1, row2, col2;
+        if (!AddBlocksToGrid(known_grid, placement, colorsA, colorsB, 0, row1, col1, row2, col2))
+            continue;
+
+        known_rates[idx] = SimulateAndRate(known_grid, row1, col1, row2, col2, scores[idx]);
+        known_scores[idx] = scores[idx];
+
+        size_t deep = 1;
+        for (; deep < MOVES; ++deep)
+        {
+            AddSkullRows(known_grid, skull_rows[deep]);
+
+            int score = PlayGreedyMove(known_grid, colorsA[deep], colorsB[deep], known_rates[idx]);
+            if (score < 0)
+                break;
+
+            known_scores[idx] += score;
+        }
+
+        valid[idx] = deep == MOVES;
+        if (deep > survivor_plies || (deep == survivor_plies && known_scores[idx] > known_scores[survivor_idx]))
+        {
+            survivor_idx = idx;
+            survivor_plies = deep;
+        }
+    }
+
+    if (find(begin(valid), end(valid), true) == end(valid))
+        return survivor_idx;
+
+    size_t combo_idx;
+    if (FindComboMove(scores, deep_bonus, other_max_score, combo_idx))
+        return combo_idx;
+
+    uint64_t random = grid.GetHash();
+    size_t rollouts = 0;
+
+    while (rollouts < max_rollouts && (rollouts == 0 || !deadline.IsExpired()))
+    {
+        for (size_t idx = 0; idx < ROOT_MOVES; ++idx)
+        {
+            if (!valid[idx])
+                continue;
+
+            GRID rollout_grid = known_grids[idx];
+            int rollout_rate = known_rates[idx];
+            int rollout_score = 0;
+            bool died = false;
+
+            for (size_t move = 0; move < MONTE_CARLO_MOVES && !died; ++move)
+            {
+                Block colorA = (Block)((size_t)Block::Color1 + SplitMix64(random) % 5);
+                Block colorB = (Block)((size_t)Block::Color1 + SplitMix64(random) % 5);
+
+                int score = PlayGreedyMove(rollout_grid, colorA, colorB, rollout_rate);
+                if (score < 0)
+                    died = true;
+                else
+                    rollout_score += score;
+            }
+
+            rollout_values[idx] += died ? CalculateMoveValue(0, rollout_score - MONTE_CARLO_DEATH_SCORE, 0, 0) : CalculateMoveValue(rollout_rate, rollout_score, 0, 0);
+        }
+
+        ++rollouts;
+    }
+
+    int64_t values[ROOT_MOVES];
+    for (size_t idx = 0; idx < ROOT_MOVES; ++idx)
+        values[idx] = valid[idx] ? CalculateMoveValue(0, known_scores[idx], 0, 0) + rollout_values[idx] / (int64_t)rollouts : numeric_limits<int64_t>::min();
+
+    return distance(begin(values), max_element(begin(values), end(values)));
+}
+
+/// Value of endgame move, plies survived are worth more than score and score more than empty cells left.
+struct EndgameValue
+{
+    int plies;
+    int score;
+    int empty;
+
+    bool operator>(const EndgameValue& other) const
+    {
+        if (plies != other.plies)
+            return plies > other.plies;
+        if (score != other.score)
+            return score > other.score;
+        return empty > other.empty;
+    }
+};
+
+/// Finds the most plies of known pieces grid survives from ply deep, grid is left with skulls of the ply dropped.
+/** Search stops as soon as one line survives all known pieces, nothing can be better. Placements which do not fit
+    are rejected by AddBlocks, so cramped grids have few children. Moves are taken back with Save and Restore,
+    grids reached by several lines share transposition table entry. Sets expired if deadline came, result is not exact then. */
+template <class GRID>
+int CalculateSurvivedPlies(GRID& grid, Block(&colorsA)[MOVES], Block(&colorsB)[MOVES], const int (&skull_rows)[MOVES], int deep, const Deadline& deadline, TranspositionTable& transpositions, bool& expired)
+{
+    if (deep == (int)MOVES)
+        return deep;
+    if (expired || (expired = deadline.IsExpired()))
+        return deep;
+
+    uint64_t key = TranspositionTable::GetKey(grid.GetHash(), deep);
+    int best;
+    size_t move;
+    if (transpositions.Probe(key, (int)MOVES - deep, best, move))
+        return best;
+
+    AddSkullRows(grid, skull_rows[deep]);
+
+    typename GRID::Undo undo;
+    grid.Save(undo);
+
+    // Line dies before this ply if no placement fits.
+    best = deep;
+
+    for (const Placement& placement : PLACEMENTS)
+    {
+        if (IsRepeatedPlacement(placement, colorsA[deep], colorsB[deep]))
+            continue;
+
+        size_t row1, col1, row2, col2;
+        if (!AddBlocksToGrid(grid, placement, colorsA, colorsB, deep, row1, col1, row2, col2))
+            continue;
+
+        grid.Simulate(row1, col1, row2, col2);
+        best = max(best, CalculateSurvivedPlies(grid, colorsA, colorsB, skull_rows, deep + 1, deadline, transpositions, expired));
+
+        grid.Restore(undo);
+
+        if (best == (int)MOVES)
+            break;
+    }
+
+    if (!expired)
+        transpositions.Store(key, (int)MOVES - deep, best, 0);
+
+    return best;
+}
+
+/// Finds how many known pieces every move of cramped grid survives and move which survives the most.
+/** Ties of best move are broken by score of move and empty cells left after it, moves which do not fit get -1 plies.
+    Returns false if deadline came or all moves survive equally long, survival tells nothing then. */
+template <class GRID, size_t N>
+bool FindEndgameMove(const GRID& grid, Block(&colorsA)[MOVES], Block(&colorsB)[MOVES], const int (&skull_rows)[MOVES], const Deadline& deadline, TranspositionTable& transpositions, EndgameValue (&values)[N], size_t& best_idx)
+{
+    transpositions.NewSearch();
+    fill(begin(values), end(values), EndgameValue{ -1, 0, 0 });
+
+    GRID calc_grid = grid;
+    AddSkullRows(calc_grid, skull_rows[0]);
+
+    typename GRID::Undo undo;
+    calc_grid.Save(undo);
+
+    bool expired = false;
+    bool found = false;
+    int min_plies = (int)MOVES;
+    EndgameValue best = { 0, 0, 0 };
+
+    // Repeated placements are not skipped, normal search may choose any of them.
+    for (const Placement& placement : PLACEMENTS)
+    {
+        size_t row1, col1, row2, col2;
+        if (!AddBlocksToGrid(calc_grid, placement, colorsA, colorsB, 0, row1, col1, row2, col2))
+            continue;
+
+        EndgameValue value;
+        value.score = calc_grid.Simulate(row1, col1, row2, col2);
+        value.empty = (int)calc_grid.CalculateBlocksNumber(Block::Empty);
+        value.plies = CalculateSurvivedPlies(calc_grid, colorsA, colorsB, skull_rows, 1, deadline, transpositions, expired);
+
+        values[placement.move] = value;
+        min_plies = min(min_plies, value.plies);
+        if (!found || value > best)
+        {
+            best = value;
+            best_idx = placement.move;
+            found = true;
+        }
+
+        calc_grid.Restore(undo);
+    }
+
+    return found && !expired && best.plies > min_plies;
+}
+
+/// Finds best score of every ply of opponent search.
+/** Moves are played on grid and taken back, grid is unchanged on return. */
+template <class GRID>
+void CalculateMaxScores(GRID& grid, Block(&colorsA)[MOVES], Block(&colorsB)[MOVES], int deep, int (&max_scores)[OPPONENT_DEEP])
+{
+    typename GRID::Undo undo;
+    grid.Save(undo);
+
+    for (const Placement& placement : PLACEMENTS)
+    {
+        if (IsRepeatedPlacement(placement, colorsA[deep], colorsB[deep]))
+            continue;
+
+        size_t row1, col1, row2, col2;
+        if (!AddBlocksToGrid(grid, placement, colorsA, colorsB, deep, row1, col1, row2, col2))
+            continue;
+
+        int score = grid.Simulate(row1, col1, row2, col2);
+        max_scores[deep] = max(max_scores[deep], score);
+
+        if (deep + 1 < (int)OPPONENT_DEEP)
+            CalculateMaxScores(grid, colorsA, colorsB, deep + 1, max_scores);
+
+        grid.Restore(undo);
+    }
+}
+
+/// Predicts skull rows which opponent drops on us.
+/** Searches opponent grid OPPONENT_DEEP plies and takes its chain which drops the most rows. Skulls of chain
+    fired at ply N fall before our move N + 1, so skull_rows[N + 1] gets full rows of that chain.
+    Returns best score of opponent's next move, 0 if no move fits. */
+template <class GRID>
+int PredictSkullRows(const GRID& other_grid, Block(&colorsA)[MOVES], Block(&colorsB)[MOVES], int (&skull_rows)[MOVES])
+{
+    int max_scores[OPPONENT_DEEP] = { 0 };
+    GRID calc_grid = other_grid;
+    CalculateMaxScores(calc_grid, colorsA, colorsB, 0, max_scores);
+
+    for (auto& rows : skull_rows)
+        rows = 0;
+
+    int best_deep = 0;
+    for (int deep = 1; deep < (int)OPPONENT_DEEP; ++deep)
+    {
+        if (max_scores[deep] / (6 * 70) > max_scores[best_deep] / (6 * 70))
+            best_deep = deep;
+    }
+
+    if (best_deep + 1 < (int)MOVES)
+        skull_rows[best_deep + 1] = max_scores[best_deep] / (6 * 70);
+
+    return max_scores[0];
 }
 
-int CalculateScore(const Grid& grid, size_t col, size_t rot, Block(&colorsA)[MOVES], Block(&colorsB)[MOVES])
+template <class GRID>
+int CalculateScore(const GRID& grid, const Placement& placement, Block(&colorsA)[MOVES], Block(&colorsB)[MOVES])
 {
-    Grid calc_grid = grid;
+    GRID calc_grid = grid;
 
     int val = numeric_limits<int>::min();
 
     size_t row1, col1, row2, col2;
-    bool added = AddBlocksToGrid(calc_grid, col, rot, colorsA, colorsB, 0, row1, col1, row2, col2);
+    bool added = AddBlocksToGrid(calc_grid, placement, colorsA, colorsB, 0, row1, col1, row2, col2);
 
     if (added)
     {
@@ -693,29 +3184,262 @@ int CalculateScore(const Grid& grid, size_t col, size_t rot, Block(&colorsA)[MOV
     return val;
 }
 
-int CalculateNextMaxScore(const Grid& grid, Block(&colorsA)[MOVES], Block(&colorsB)[MOVES])
+template <class GRID>
+int CalculateNextMaxScore(const GRID& grid, Block(&colorsA)[MOVES], Block(&colorsB)[MOVES])
+{
+    int max_score = numeric_limits<int>::min();
+
+    for (const Placement& placement : PLACEMENTS)
+        max_score = max(max_score, CalculateScore(grid, placement, colorsA, colorsB));
+
+    return max_score;
+}
+
+/// One turn of game stored in binary replay file.
+/** Holds pieces, both grids and move chosen in that turn. Colors of pair are packed in one byte,
+    grid cells two per byte as block value + 1, rows go from bottom. */
+struct TurnRecord
 {
-    int values[Grid::COLS * ROTS] = { 0 };
+    static const size_t GRID_BYTES = Grid::ROWS * Grid::COLS / 2;
+
+    uint8_t colors[MOVES];
+    uint8_t my_grid[GRID_BYTES];
+    uint8_t other_grid[GRID_BYTES];
+    uint8_t move;
+
+    void SetColors(Block(&colorsA)[MOVES], Block(&colorsB)[MOVES])
+    {
+        for (size_t i = 0; i < MOVES; ++i)
+            colors[i] = (uint8_t)(((int)colorsA[i] + 1) | (((int)colorsB[i] + 1) << 4));
+    }
 
-    for (size_t col = 0; col < Grid::COLS; ++col)
+    void GetColors(Block(&colorsA)[MOVES], Block(&colorsB)[MOVES]) const
     {
-        for (size_t rot = 0; rot < ROTS; ++rot)
+        for (size_t i = 0; i < MOVES; ++i)
         {
-            values[col * ROTS + rot] = CalculateScore(grid, col, rot, colorsA, colorsB);
+            colorsA[i] = (Block)((colors[i] & 0xF) - 1);
+            colorsB[i] = (Block)((colors[i] >> 4) - 1);
         }
     }
 
-    auto max_it = max_element(begin(values), end(values));
+    template <class GRID>
+    static void PackGrid(const GRID& grid, uint8_t (&cells)[GRID_BYTES])
+    {
+        memset(cells, 0, sizeof(cells));
+        for (size_t row = 0; row < Grid::ROWS; ++row)
+        {
+            for (size_t col = 0; col < Grid::COLS; ++col)
+            {
+                size_t idx = row * Grid::COLS + col;
+                cells[idx / 2] |= (uint8_t)(((int)grid.Get(row, col) + 1) << (idx % 2 * 4));
+            }
+        }
+    }
+
+    /// Fills grid from packed cells through its text reading, so hash and cached state of grid are set up.
+    template <class GRID>
+    static void UnpackGrid(const uint8_t (&cells)[GRID_BYTES], GRID& grid)
+    {
+        string lines[Grid::ROWS];
+        for (size_t i = 0; i < Grid::ROWS; ++i)
+        {
+            size_t row = Grid::ROWS - 1 - i;
+            for (size_t col = 0; col < Grid::COLS; ++col)
+            {
+                size_t idx = row * Grid::COLS + col;
+                lines[i] += CharFromBlock((Block)(((cells[idx / 2] >> (idx % 2 * 4)) & 0xF) - 1));
+            }
+        }
+
+        grid.Read(lines);
+    }
+};
+
+static_assert(sizeof(TurnRecord) == MOVES + 2 * TurnRecord::GRID_BYTES + 1, "TurnRecord must have no padding.");
+
+/// Tag at start of replay file, changed with layout of TurnRecord.
+static const char TURN_RECORD_MAGIC[4] = { 'S', 'T', 'C', '1' };
 
-    return *max_it;
+/// Writes turns to binary replay file.
+/** File is flushed after every turn, so game killed by timeout still leaves all turns played before. */
+class TurnRecorder
+{
+public:
+    explicit TurnRecorder(const char* path) : m_Out(path, ios::binary | ios::trunc)
+    {
+        m_Out.write(TURN_RECORD_MAGIC, sizeof(TURN_RECORD_MAGIC));
+    }
+
+    bool IsOpen() const
+    {
+        return m_Out.good();
+    }
+
+    void Write(const TurnRecord& record)
+    {
+        m_Out.write(reinterpret_cast<const char*>(&record), sizeof(record));
+        m_Out.flush();
+    }
+
+private:
+    ofstream m_Out;
+};
+
+/// Reads turns of binary replay file written by TurnRecorder.
+class TurnReplay
+{
+public:
+    explicit TurnReplay(const char* path) : m_In(path, ios::binary)
+    {
+        char magic[sizeof(TURN_RECORD_MAGIC)];
+        if (!m_In.read(magic, sizeof(magic)) || memcmp(magic, TURN_RECORD_MAGIC, sizeof(magic)) != 0)
+            m_In.setstate(ios::failbit);
+    }
+
+    /// Returns false if file cannot be opened or was not written by TurnRecorder.
+    bool IsOpen() const
+    {
+        return m_In.good();
+    }
+
+    /// Returns false after last whole turn.
+    bool Read(TurnRecord& record)
+    {
+        return !!m_In.read(reinterpret_cast<char*>(&record), sizeof(record));
+    }
+
+private:
+    ifstream m_In;
+};
+
+#ifndef SMASH_THE_CODE_NO_MAIN
+/// Chooses move of one turn, game loop and replay of recorded turns use the same decision.
+size_t ChooseMove(const SearchGrid& MyGrid, const SearchGrid& OtherGrid, Block(&colorsA)[MOVES], Block(&colorsB)[MOVES], Deadline::Clock::time_point turn_start)
+{
+    static TranspositionTable transpositions;
+    static BeamCarry<SearchGrid> beam_carry;
+
+    int deep_bonus = 1;
+
+    int skull_rows[MOVES];
+    int other_best_score = PredictSkullRows(OtherGrid, colorsA, colorsB, skull_rows);
+
+    const Weights& weights = GetWeights();
+
+    if (other_best_score >= 6 * 70 * weights.danger_rows)
+        deep_bonus = -1;
+    else if (other_best_score >= 6 * 70 * weights.threat_rows)
+        deep_bonus = 0;
+
+#if !USE_MONTE_CARLO
+    // Monte Carlo rollouts always play out all known pieces, only tree searches are cut short under threat.
+    int max_deep = MOVES - 1;
+    if (other_best_score >= 6 * 70 * weights.danger_rows)
+        max_deep = 0;
+    else if (other_best_score >= 6 * 70 * weights.threat_rows)
+        max_deep = 1;
+#endif
+
+    size_t skulls_num = MyGrid.CalculateBlocksNumber(Block::Skull);
+    if (skulls_num >= 6 * (size_t)weights.skull_rows_limit)
+        deep_bonus = min(deep_bonus, 0);
+    size_t empty_num = MyGrid.CalculateBlocksNumber(Block::Empty);
+    if (empty_num <= 6 * (size_t)weights.empty_rows_limit)
+        deep_bonus = min(deep_bonus, 0);
+    size_t oter_empty_num = OtherGrid.CalculateBlocksNumber(Block::Empty);
+    if (oter_empty_num <= 6 * (size_t)weights.empty_rows_limit)
+        deep_bonus = min(deep_bonus, 0);
+
+    Deadline deadline(turn_start, chrono::milliseconds(TURN_TIME_MS));
+
+    // Cramped grid has few legal placements, so survival of all lines of known pieces can be checked in part of turn.
+    // Predicted skulls are the worst case of opponent search and made survival override good moves, so lines are
+    // checked without them and only certain deaths count.
+    EndgameValue endgame_values[SearchGrid::COLS * ROTS];
+    size_t endgame_idx = 0;
+    int no_skull_rows[MOVES] = { 0 };
+    Deadline endgame_deadline(turn_start, chrono::milliseconds(TURN_TIME_MS / 2));
+    bool endgame = empty_num <= 6 * (size_t)weights.empty_rows_limit &&
+        FindEndgameMove(MyGrid, colorsA, colorsB, no_skull_rows, endgame_deadline, transpositions, endgame_values, endgame_idx);
+
+#if USE_MONTE_CARLO
+    size_t best_idx = FindBestMoveMonteCarlo(MyGrid, colorsA, colorsB, skull_rows, deep_bonus, other_best_score, MONTE_CARLO_ROLLOUTS, deadline);
+#elif USE_BEAM_SEARCH
+    size_t best_idx = FindBestMoveBeam(MyGrid, colorsA, colorsB, skull_rows, max_deep, BEAM_WIDTH, deep_bonus, other_best_score, deadline, REUSE_BEAM ? &beam_carry : nullptr);
+#else
+    size_t best_idx = FindBestMoveIterative(MyGrid, colorsA, colorsB, skull_rows, max_deep, deep_bonus, other_best_score, deadline, &transpositions, SEARCH_THREADS);
+#endif
+
+    // Move of normal search is kept unless it dies before the end of known pieces earlier than it must.
+    // Scoring moves are kept too, their skulls may bury opponent first.
+    const EndgameValue& search_value = endgame_values[best_idx];
+    if (endgame && search_value.plies < endgame_values[endgame_idx].plies && search_value.score == 0)
+        best_idx = endgame_idx;
+
+    return best_idx;
+}
+
+/// Chooses moves of recorded turns again, writes them as in game and reports turns where move changed.
+/** Search is limited by time, so move can change with load of machine too, not only with changes of code. */
+bool ReplayTurns(const char* path)
+{
+    TurnReplay replay(path);
+    if (!replay.IsOpen())
+    {
+        cerr << "Cannot open replay " << path << endl;
+        return false;
+    }
+
+    size_t turns = 0;
+    size_t changed = 0;
+
+    TurnRecord record;
+    while (replay.Read(record))
+    {
+        Block colorsA[MOVES];
+        Block colorsB[MOVES];
+        record.GetColors(colorsA, colorsB);
+
+        SearchGrid MyGrid;
+        SearchGrid OtherGrid;
+        TurnRecord::UnpackGrid(record.my_grid, MyGrid);
+        TurnRecord::UnpackGrid(record.other_grid, OtherGrid);
+
+        Deadline::Clock::time_point turn_start = Deadline::Clock::now();
+        STATS(s_Stats.Reset());
+
+        size_t best_idx = ChooseMove(MyGrid, OtherGrid, colorsA, colorsB, turn_start);
+
+        cout << best_idx / ROTS << ' ' << best_idx % ROTS << endl;
+
+        STATS(s_Stats.Print(cerr, best_idx, Deadline::Clock::now() - turn_start));
+
+        if (best_idx != record.move)
+        {
+            cerr << "Turn " << turns << ": recorded " << record.move / ROTS << ' ' << record.move % ROTS << endl;
+            ++changed;
+        }
+
+        ++turns;
+    }
+
+    cerr << "Replayed " << turns << " turns, " << changed << " moves changed" << endl;
+    return true;
 }
 
 /**
 * Auto-generated code below aims at helping you parse
 * the standard input according to the problem statement.
 **/
+#if LOAD_WEIGHTS
+int main(int argc, char* argv[])
+{
+    if (argc > 1 && !LoadWeights(argv[1]))
+        return 1;
+#else
 int main()
 {
+#endif
     if (0)
     {
         string lines[] = {
@@ -744,7 +3468,7 @@ int main()
             //"315...",
             //"311..."
         };
-        Grid MyGrid;
+        SearchGrid MyGrid;
 
         Block colorsA[MOVES] = { Block::Color5, Block::Color2, Block::Color4, Block::Color1, Block::Color5, Block::Color2, Block::Color2, Block::Color1 };
         Block colorsB[MOVES] = { Block::Color3, Block::Color4, Block::Color4, Block::Color1, Block::Color3, Block::Color1, Block::Color3, Block::Color5 };
@@ -752,7 +3476,9 @@ int main()
         MyGrid.Read(lines);
         MyGrid.Print(cerr);
 
-        size_t best_idx = FindBestMove(MyGrid, colorsA, colorsB, 2, 1, 0);
+        int skull_rows[MOVES] = { 0 };
+
+        size_t best_idx = FindBestMove(MyGrid, colorsA, colorsB, skull_rows, 2, 1, 0, Deadline(), nullptr);
 
         int col = best_idx / ROTS;
         int rot = best_idx % ROTS;
@@ -762,62 +3488,59 @@ int main()
         return 0;
     }
 
-    Grid MyGrid;
-    Grid OtherGrid;
+#if REPLAY_TURNS
+    return ReplayTurns(TURN_RECORD_PATH) ? 0 : 1;
+#endif
+
+    SearchGrid MyGrid;
+    SearchGrid OtherGrid;
+
+    static InputReader input(0);
+#if RECORD_TURNS
+    static TurnRecorder recorder(TURN_RECORD_PATH);
+    if (!recorder.IsOpen())
+        cerr << "Cannot open record " << TURN_RECORD_PATH << endl;
+#endif
 
     // game loop
     while (1) {
         Block colorsA[MOVES] = { Block::Skull };
         Block colorsB[MOVES] = { Block::Skull };
 
-        for (int i = 0; i < MOVES; i++)
+        Deadline::Clock::time_point turn_start;
+
+        for (size_t i = 0; i < MOVES; i++)
         {
             char colA, colB;
-            cin >> colA >> colB; cin.ignore();
+            if (!input.ReadChar(colA) || !input.ReadChar(colB))
+                return 0;
+
+            if (i == 0)
+            {
+                turn_start = Deadline::Clock::now();
+                STATS(s_Stats.Reset());
+            }
 
             colorsA[i] = BlockFromChar(colA);
             colorsB[i] = BlockFromChar(colB);
         }
 
-        MyGrid.Read(cin);
+        if (!MyGrid.Read(input))
+            return 0;
         //MyGrid.Print(cerr);
 
-        OtherGrid.Read(cin);
+        if (!OtherGrid.Read(input))
+            return 0;
         //OtherGrid.Print(cerr);
 
-        int max_deep = 2;
-        int deep_bonus = 1;
-
-        int other_best_score = CalculateNextMaxScore(OtherGrid, colorsA, colorsB);
-
-        if (other_best_score >= 6 * 70 * 12)
-            deep_bonus = -1;
-        else if (other_best_score >= 6 * 70 * 8)
-            deep_bonus = 0;
-
-        if (other_best_score >= 6 * 70 * 12)
-            max_deep = 0;
-        else if (other_best_score >= 6 * 70 * 8)
-            max_deep = 1;
-
-        size_t skulls_num = MyGrid.CalculateBlocksNumber(Block::Skull);
-        if (skulls_num >= 6 * 4)
-            deep_bonus = min(deep_bonus, 0);
-        size_t empty_num = MyGrid.CalculateBlocksNumber(Block::Empty);
-        if (empty_num <= 6 * 2)
-            deep_bonus = min(deep_bonus, 0);
-        size_t oter_empty_num = OtherGrid.CalculateBlocksNumber(Block::Empty);
-        if (oter_empty_num <= 6 * 2)
-            deep_bonus = min(deep_bonus, 0);
-
-        size_t best_idx = FindBestMove(MyGrid, colorsA, colorsB, max_deep, deep_bonus, other_best_score);
+        size_t best_idx = ChooseMove(MyGrid, OtherGrid, colorsA, colorsB, turn_start);
 
         int col = best_idx / ROTS;
         int rot = best_idx % ROTS;
 
         if (0)
         {
-            Grid calc_grid = MyGrid;
+            SearchGrid calc_grid = MyGrid;
             size_t row1, col1, row2, col2;
             bool added = AddBlocksToGrid(calc_grid, col, rot, colorsA, colorsB, 0, row1, col1, row2, col2);
 
@@ -828,9 +3551,22 @@ int main()
 
         if (0)
         {
-            cerr << "Other: " << other_best_score << endl;
+            cerr << "Other: " << CalculateNextMaxScore(OtherGrid, colorsA, colorsB) << endl;
         }
 
         cout << col << ' ' << rot << endl; // "x": the column in which to drop your blocks
+
+        STATS(s_Stats.Print(cerr, best_idx, Deadline::Clock::now() - turn_start));
+
+#if RECORD_TURNS
+        // Written after move is sent, so file output does not take time of turn.
+        TurnRecord record;
+        record.SetColors(colorsA, colorsB);
+        TurnRecord::PackGrid(MyGrid, record.my_grid);
+        TurnRecord::PackGrid(OtherGrid, record.other_grid);
+        record.move = (uint8_t)best_idx;
+        recorder.Write(record);
+#endif
     }
 }
+#endif
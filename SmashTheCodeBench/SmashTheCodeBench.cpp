@@ -0,0 +1,229 @@
+/// Offline benchmark of SmashTheCode search.
+/** Reads corpus of recorded turns in game input format (8 pairs, own grid, opponent grid)
+    or binary replay file written by bot with RECORD_TURNS (.rec extension), runs FindBestMove at every depth up to given one and reports throughput, latency and checksum of chosen moves.
+    Mode beam runs FindBestMoveBeam with BEAM_WIDTH instead, as bot with USE_BEAM_SEARCH does, its checksums differ from tree mode.
+    Usage: SmashTheCodeBench [corpus_file] [max_deep] [tree|beam] */
+#define SMASH_THE_CODE_NO_MAIN
+#include "../SmashTheCode/SmashTheCode.cpp"
+
+#include <fstream>
+#include <iomanip>
+#include <cstdlib>
+
+/// Counters of work done by search.
+struct BenchCounters
+{
+    uint64_t m_Nodes;
+    uint64_t m_Simulations;
+};
+
+static BenchCounters s_Counters = { 0, 0 };
+
+/// Grid counting copies made by search as nodes and Simulate calls.
+template <class GRID>
+class CountingGrid : public GRID
+{
+public:
+    CountingGrid() {}
+    CountingGrid(const GRID& grid) : GRID(grid) {}
+    CountingGrid(const CountingGrid& other) : GRID(other) { ++s_Counters.m_Nodes; }
+    CountingGrid& operator=(const CountingGrid& other)
+    {
+        GRID::operator=(other);
+        ++s_Counters.m_Nodes;
+        return *this;
+    }
+
+    int Simulate(size_t row1, size_t col1, size_t row2, size_t col2, int* chains = nullptr)
+    {
+        ++s_Counters.m_Simulations;
+        return GRID::Simulate(row1, col1, row2, col2, chains);
+    }
+};
+
+typedef CountingGrid<SearchGrid> BenchGrid;
+
+/// One recorded turn.
+struct BenchTurn
+{
+    Block m_ColorsA[MOVES];
+    Block m_ColorsB[MOVES];
+    SearchGrid m_MyGrid;
+    SearchGrid m_OtherGrid;
+};
+
+bool ReadTurn(istream& in, BenchTurn& turn)
+{
+    for (size_t i = 0; i < MOVES; i++)
+    {
+        char colA, colB;
+        if (!(in >> colA >> colB))
+            return false;
+        in.ignore();
+
+        turn.m_ColorsA[i] = BlockFromChar(colA);
+        turn.m_ColorsB[i] = BlockFromChar(colB);
+    }
+
+    turn.m_MyGrid.Read(in);
+    turn.m_OtherGrid.Read(in);
+
+    return !in.fail();
+}
+
+/// Reads all turns of binary replay file.
+bool ReadReplay(const char* path, vector<BenchTurn>& turns)
+{
+    TurnReplay replay(path);
+    if (!replay.IsOpen())
+        return false;
+
+    TurnRecord record;
+    BenchTurn turn;
+    while (replay.Read(record))
+    {
+        record.GetColors(turn.m_ColorsA, turn.m_ColorsB);
+        TurnRecord::UnpackGrid(record.my_grid, turn.m_MyGrid);
+        TurnRecord::UnpackGrid(record.other_grid, turn.m_OtherGrid);
+        turns.push_back(turn);
+    }
+
+    return true;
+}
+
+/// Returns true if path has .rec extension of replay files.
+bool IsReplayPath(const string& path)
+{
+    static const string EXTENSION = ".rec";
+    return path.size() >= EXTENSION.size() && path.compare(path.size() - EXTENSION.size(), EXTENSION.size(), EXTENSION) == 0;
+}
+
+/// Search which is measured.
+enum class BenchMode
+{
+    Tree,
+    Beam,
+};
+
+/// Returns given percentile of sorted samples.
+double Percentile(const vector<double>& sorted, size_t percent)
+{
+    if (sorted.empty())
+        return 0.0;
+
+    return sorted[min(sorted.size() - 1, sorted.size() * percent / 100)];
+}
+
+/// Mixes move into FNV-1a checksum.
+uint32_t MixChecksum(uint32_t checksum, size_t move)
+{
+    return (checksum ^ static_cast<uint32_t>(move)) * 16777619u;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* corpus_path = argc > 1 ? argv[1] : "corpus.txt";
+    int max_deep = argc > 2 ? atoi(argv[2]) : 2;
+    const string mode_name = argc > 3 ? argv[3] : "tree";
+
+    BenchMode mode;
+    if (mode_name == "tree")
+        mode = BenchMode::Tree;
+    else if (mode_name == "beam")
+        mode = BenchMode::Beam;
+    else
+    {
+        cerr << "Unknown mode " << mode_name << endl;
+        return 1;
+    }
+
+    vector<BenchTurn> turns;
+    if (IsReplayPath(corpus_path))
+    {
+        if (!ReadReplay(corpus_path, turns))
+        {
+            cerr << "Cannot open replay " << corpus_path << endl;
+            return 1;
+        }
+    }
+    else
+    {
+        ifstream corpus(corpus_path);
+        if (!corpus)
+        {
+            cerr << "Cannot open corpus " << corpus_path << endl;
+            return 1;
+        }
+
+        BenchTurn turn;
+        while (ReadTurn(corpus, turn))
+            turns.push_back(turn);
+    }
+
+    if (turns.empty())
+    {
+        cerr << "Empty corpus " << corpus_path << endl;
+        return 1;
+    }
+
+    static TranspositionTable transpositions;
+
+    cout << "turns: " << turns.size() << ", mode: " << mode_name << endl;
+    cout << "deep   nodes/turn      nodes/s   simulate/s    p50 ms    p99 ms  checksum" << endl;
+
+    uint32_t total_checksum = 2166136261u;
+
+    for (int deep = 0; deep <= max_deep && deep < static_cast<int>(MOVES); deep++)
+    {
+        vector<double> latencies;
+        latencies.reserve(turns.size());
+
+        uint32_t checksum = 2166136261u;
+        uint64_t nodes = 0;
+        uint64_t simulations = 0;
+        double total_seconds = 0.0;
+
+        for (BenchTurn& bench_turn : turns)
+        {
+            BenchGrid my_grid(bench_turn.m_MyGrid);
+            BenchGrid other_grid(bench_turn.m_OtherGrid);
+
+            int skull_rows[MOVES];
+            int other_max_score = PredictSkullRows(other_grid, bench_turn.m_ColorsA, bench_turn.m_ColorsB, skull_rows);
+
+            transpositions.NewSearch();
+            s_Counters.m_Nodes = 0;
+            s_Counters.m_Simulations = 0;
+
+            Deadline::Clock::time_point start = Deadline::Clock::now();
+            size_t best_idx = mode == BenchMode::Beam ?
+                FindBestMoveBeam(my_grid, bench_turn.m_ColorsA, bench_turn.m_ColorsB, skull_rows, deep, BEAM_WIDTH, 1, other_max_score, Deadline(), static_cast<BeamCarry<BenchGrid>*>(nullptr)) :
+                FindBestMove(my_grid, bench_turn.m_ColorsA, bench_turn.m_ColorsB, skull_rows, deep, 1, other_max_score, Deadline(), &transpositions);
+            double seconds = chrono::duration<double>(Deadline::Clock::now() - start).count();
+
+            latencies.push_back(seconds * 1000.0);
+            total_seconds += seconds;
+            nodes += s_Counters.m_Nodes;
+            simulations += s_Counters.m_Simulations;
+            checksum = MixChecksum(checksum, best_idx);
+            total_checksum = MixChecksum(total_checksum, best_idx);
+        }
+
+        sort(latencies.begin(), latencies.end());
+
+        double seconds = max(total_seconds, 1e-9);
+        cout << setw(4) << deep
+            << setw(13) << nodes / turns.size()
+            << setw(13) << static_cast<uint64_t>(nodes / seconds)
+            << setw(13) << static_cast<uint64_t>(simulations / seconds)
+            << fixed << setprecision(3)
+            << setw(10) << Percentile(latencies, 50)
+            << setw(10) << Percentile(latencies, 99)
+            << "  " << hex << setw(8) << setfill('0') << checksum << dec << setfill(' ')
+            << defaultfloat << endl;
+    }
+
+    cout << "total checksum: " << hex << setw(8) << setfill('0') << total_checksum << dec << endl;
+
+    return 0;
+}
@@ -0,0 +1,545 @@
+/// Local referee of SmashTheCode self-play.
+/** Plays two bot executables against each other with rules of the game, Grid::Simulate scores moves.
+    Every seed of pieces is played twice with swapped players. Games run in parallel worker threads,
+    each game starts its own pair of bot processes talking through stdin/stdout pipes.
+    Usage: SmashTheCodeReferee "bot1 [args]" "bot2 [args]" [games] [threads] */
+#define SMASH_THE_CODE_NO_MAIN
+#include "../SmashTheCode/SmashTheCode.cpp"
+
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <csignal>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#endif
+
+/// Game ends in draw after this many turns if nobody lost, the higher total score wins.
+static const int MAX_TURNS = 200;
+/// Turn time limit of arena, longer turns are only counted.
+static const double TURN_LIMIT_MS = 100.0;
+/// Bot which does not answer within this time is taken as hung, it is killed and loses the game.
+static const int BOT_TIMEOUT_MS = 2000;
+
+/// Process creation is serialized, so pipes of one bot are not inherited by other bots.
+static mutex s_SpawnMutex;
+
+/// Bot running in child process, talks through stdin/stdout pipes, stderr is discarded.
+class BotProcess
+{
+public:
+    BotProcess() {}
+    BotProcess(const BotProcess&) = delete;
+    BotProcess& operator=(const BotProcess&) = delete;
+
+    ~BotProcess()
+    {
+        Stop();
+    }
+
+    /// Starts bot, command is executable path followed by arguments separated by spaces.
+    bool Start(const string& command);
+
+    /// Writes input text to bot.
+    bool Send(const string& text);
+
+    enum class ReceiveStatus
+    {
+        Line,
+        Closed,
+        Timeout,
+    };
+
+    /// Reads one line of bot output without line end, waits for it until deadline.
+    ReceiveStatus ReceiveLine(string& line, Deadline::Clock::time_point deadline);
+
+    void Stop();
+
+private:
+    /// Moves first complete line of pending output to line.
+    bool TakeLine(string& line)
+    {
+        size_t end = m_Pending.find('\n');
+        if (end == string::npos)
+            return false;
+
+        line.assign(m_Pending, 0, end);
+        line.erase(remove(line.begin(), line.end(), '\r'), line.end());
+        m_Pending.erase(0, end + 1);
+        return true;
+    }
+
+    /// Output read from pipe but not returned as line yet.
+    string m_Pending;
+
+#if defined(_WIN32)
+    HANDLE m_Process = NULL;
+    HANDLE m_Input = NULL;
+    HANDLE m_Output = NULL;
+#else
+    pid_t m_Pid = -1;
+    int m_Input = -1;
+    int m_Output = -1;
+#endif
+};
+
+#if defined(_WIN32)
+bool BotProcess::Start(const string& command)
+{
+    lock_guard<mutex> lock(s_SpawnMutex);
+
+    SECURITY_ATTRIBUTES inherit = { sizeof(SECURITY_ATTRIBUTES), NULL, TRUE };
+
+    HANDLE child_input, child_output;
+    if (!CreatePipe(&child_input, &m_Input, &inherit, 0))
+        return false;
+    if (!CreatePipe(&m_Output, &child_output, &inherit, 0))
+    {
+        CloseHandle(child_input);
+        return false;
+    }
+
+    SetHandleInformation(m_Input, HANDLE_FLAG_INHERIT, 0);
+    SetHandleInformation(m_Output, HANDLE_FLAG_INHERIT, 0);
+
+    HANDLE null_error = CreateFileA("NUL", GENERIC_WRITE, FILE_SHARE_WRITE, &inherit, OPEN_EXISTING, 0, NULL);
+
+    STARTUPINFOA startup = {};
+    startup.cb = sizeof(startup);
+    startup.dwFlags = STARTF_USESTDHANDLES;
+    startup.hStdInput = child_input;
+    startup.hStdOutput = child_output;
+    startup.hStdError = null_error;
+
+    PROCESS_INFORMATION info = {};
+    vector<char> command_line(command.begin(), command.end());
+    command_line.push_back('\0');
+
+    BOOL started = CreateProcessA(NULL, command_line.data(), NULL, NULL, TRUE, 0, NULL, NULL, &startup, &info);
+
+    CloseHandle(child_input);
+    CloseHandle(child_output);
+    CloseHandle(null_error);
+
+    if (!started)
+        return false;
+
+    CloseHandle(info.hThread);
+    m_Process = info.hProcess;
+    return true;
+}
+
+bool BotProcess::Send(const string& text)
+{
+    DWORD written;
+    return WriteFile(m_Input, text.data(), (DWORD)text.size(), &written, NULL) && written == text.size();
+}
+
+BotProcess::ReceiveStatus BotProcess::ReceiveLine(string& line, Deadline::Clock::time_point deadline)
+{
+    line.clear();
+
+    // Anonymous pipes have no overlapped reads, so pipe is polled and only available bytes are read.
+    while (!TakeLine(line))
+    {
+        DWORD available = 0;
+        if (!m_Output || !PeekNamedPipe(m_Output, NULL, 0, NULL, &available, NULL))
+            return ReceiveStatus::Closed;
+
+        if (available == 0)
+        {
+            if (Deadline::Clock::now() >= deadline)
+                return ReceiveStatus::Timeout;
+
+            Sleep(1);
+            continue;
+        }
+
+        char buffer[256];
+        DWORD read;
+        if (!ReadFile(m_Output, buffer, min<DWORD>(available, sizeof(buffer)), &read, NULL) || read == 0)
+            return ReceiveStatus::Closed;
+
+        m_Pending.append(buffer, read);
+    }
+
+    return ReceiveStatus::Line;
+}
+
+void BotProcess::Stop()
+{
+    if (m_Process)
+    {
+        TerminateProcess(m_Process, 0);
+        WaitForSingleObject(m_Process, INFINITE);
+        CloseHandle(m_Process);
+        m_Process = NULL;
+    }
+    if (m_Input)
+    {
+        CloseHandle(m_Input);
+        m_Input = NULL;
+    }
+    if (m_Output)
+    {
+        CloseHandle(m_Output);
+        m_Output = NULL;
+    }
+    m_Pending.clear();
+}
+#else
+bool BotProcess::Start(const string& command)
+{
+    vector<string> args;
+    istringstream command_in(command);
+    for (string arg; command_in >> arg;)
+        args.push_back(arg);
+
+    if (args.empty())
+        return false;
+
+    vector<char*> argv;
+    for (string& arg : args)
+        argv.push_back(&arg[0]);
+    argv.push_back(nullptr);
+
+    lock_guard<mutex> lock(s_SpawnMutex);
+
+    int input[2], output[2];
+    if (pipe(input) != 0)
+        return false;
+    if (pipe(output) != 0)
+    {
+        close(input[0]);
+        close(input[1]);
+        return false;
+    }
+
+    fcntl(input[1], F_SETFD, FD_CLOEXEC);
+    fcntl(output[0], F_SETFD, FD_CLOEXEC);
+
+    m_Pid = fork();
+    if (m_Pid == 0)
+    {
+        dup2(input[0], STDIN_FILENO);
+        dup2(output[1], STDOUT_FILENO);
+        int null_error = open("/dev/null", O_WRONLY);
+        if (null_error >= 0)
+            dup2(null_error, STDERR_FILENO);
+
+        close(input[0]);
+        close(output[1]);
+        execvp(argv[0], argv.data());
+        _exit(127);
+    }
+
+    close(input[0]);
+    close(output[1]);
+
+    if (m_Pid < 0)
+    {
+        close(input[1]);
+        close(output[0]);
+        return false;
+    }
+
+    m_Input = input[1];
+    m_Output = output[0];
+    return true;
+}
+
+bool BotProcess::Send(const string& text)
+{
+    size_t sent = 0;
+    while (sent < text.size())
+    {
+        ssize_t written = write(m_Input, text.data() + sent, text.size() - sent);
+        if (written <= 0)
+            return false;
+
+        sent += (size_t)written;
+    }
+
+    return true;
+}
+
+BotProcess::ReceiveStatus BotProcess::ReceiveLine(string& line, Deadline::Clock::time_point deadline)
+{
+    line.clear();
+
+    while (!TakeLine(line))
+    {
+        if (m_Output < 0)
+            return ReceiveStatus::Closed;
+
+        auto left = chrono::duration_cast<chrono::milliseconds>(deadline - Deadline::Clock::now()).count();
+        if (left <= 0)
+            return ReceiveStatus::Timeout;
+
+        pollfd output = { m_Output, POLLIN, 0 };
+        int ready = poll(&output, 1, (int)left);
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready < 0)
+            return ReceiveStatus::Closed;
+        if (ready == 0)
+            return ReceiveStatus::Timeout;
+
+        char buffer[256];
+        ssize_t got = read(m_Output, buffer, sizeof(buffer));
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return ReceiveStatus::Closed;
+
+        m_Pending.append(buffer, (size_t)got);
+    }
+
+    return ReceiveStatus::Line;
+}
+
+void BotProcess::Stop()
+{
+    if (m_Pid > 0)
+    {
+        kill(m_Pid, SIGKILL);
+        waitpid(m_Pid, nullptr, 0);
+        m_Pid = -1;
+    }
+    if (m_Input >= 0)
+    {
+        close(m_Input);
+        m_Input = -1;
+    }
+    if (m_Output >= 0)
+    {
+        close(m_Output);
+        m_Output = -1;
+    }
+    m_Pending.clear();
+}
+#endif
+
+/// Result of one game, seen from the first bot.
+enum class GameResult
+{
+    Loss,
+    Draw,
+    Win,
+};
+
+/// Turn latencies of one bot, shared by all games.
+struct LatencyStats
+{
+    mutex m_Mutex;
+    vector<double> m_Latencies;
+    /// Games lost by not answering within BOT_TIMEOUT_MS.
+    size_t m_Timeouts = 0;
+
+    void Add(const vector<double>& latencies, bool timed_out)
+    {
+        lock_guard<mutex> lock(m_Mutex);
+        m_Latencies.insert(m_Latencies.end(), latencies.begin(), latencies.end());
+        if (timed_out)
+            ++m_Timeouts;
+    }
+};
+
+/// Player state of one game.
+struct Player
+{
+    Grid m_Grid;
+    int m_Score = 0;
+    /// Points not yet sent as skull rows to opponent.
+    int m_NuisancePoints = 0;
+    bool m_Lost = false;
+    bool m_TimedOut = false;
+    vector<double> m_Latencies;
+};
+
+/// Writes turn input of player in game format.
+string WriteTurnInput(const Player& player, const Player& other, const vector<pair<Block, Block>>& pieces, size_t turn)
+{
+    ostringstream input;
+    for (size_t i = 0; i < MOVES; ++i)
+        input << CharFromBlock(pieces[turn + i].first) << ' ' << CharFromBlock(pieces[turn + i].second) << '\n';
+    player.m_Grid.Print(input);
+    other.m_Grid.Print(input);
+
+    return input.str();
+}
+
+/// Sends turn input to bot, reads its move and plays it, returns false if move is illegal or bot failed.
+/** Bot which does not answer within BOT_TIMEOUT_MS is killed. */
+bool PlayTurn(BotProcess& bot, Player& player, const string& input, const vector<pair<Block, Block>>& pieces, size_t turn)
+{
+    Deadline::Clock::time_point start = Deadline::Clock::now();
+
+    if (!bot.Send(input))
+        return false;
+
+    string line;
+    BotProcess::ReceiveStatus status = bot.ReceiveLine(line, start + chrono::milliseconds(BOT_TIMEOUT_MS));
+    if (status == BotProcess::ReceiveStatus::Timeout)
+    {
+        player.m_TimedOut = true;
+        bot.Stop();
+    }
+    if (status != BotProcess::ReceiveStatus::Line)
+        return false;
+
+    player.m_Latencies.push_back(chrono::duration<double, milli>(Deadline::Clock::now() - start).count());
+
+    istringstream move(line);
+    int col, rot;
+    if (!(move >> col >> rot) || col < 0 || rot < 0)
+        return false;
+
+    const Placement* placement = GetPlacement((size_t)col, (size_t)rot);
+    size_t row1, col1, row2, col2;
+    if (!placement || !AddBlocksToGrid(player.m_Grid, *placement, pieces[turn].first, pieces[turn].second, row1, col1, row2, col2))
+        return false;
+
+    int score = player.m_Grid.Simulate(row1, col1, row2, col2);
+    player.m_Score += score;
+    player.m_NuisancePoints += score;
+    return true;
+}
+
+/// Plays one game, pieces come from seed.
+GameResult PlayGame(const string& command1, const string& command2, uint64_t seed, LatencyStats& stats1, LatencyStats& stats2)
+{
+    vector<pair<Block, Block>> pieces;
+    for (size_t i = 0; i < MAX_TURNS + MOVES; ++i)
+    {
+        Block colorA = (Block)((size_t)Block::Color1 + SplitMix64(seed) % 5);
+        Block colorB = (Block)((size_t)Block::Color1 + SplitMix64(seed) % 5);
+        pieces.push_back(make_pair(colorA, colorB));
+    }
+
+    BotProcess bots[2];
+    Player players[2];
+    players[0].m_Lost = !bots[0].Start(command1);
+    players[1].m_Lost = !bots[1].Start(command2);
+
+    size_t turn = 0;
+    for (; turn < MAX_TURNS && !players[0].m_Lost && !players[1].m_Lost; ++turn)
+    {
+        // Both bots see grids from before the turn, bots think one after other so they do not share CPU.
+        string inputs[2] = { WriteTurnInput(players[0], players[1], pieces, turn), WriteTurnInput(players[1], players[0], pieces, turn) };
+        for (size_t idx = 0; idx < 2; ++idx)
+            players[idx].m_Lost = !PlayTurn(bots[idx], players[idx], inputs[idx], pieces, turn);
+
+        // Full rows of skulls fall on opponent, points of incomplete rows are kept for later turns.
+        for (size_t idx = 0; idx < 2; ++idx)
+        {
+            int rows = players[idx].m_NuisancePoints / (6 * 70);
+            players[idx].m_NuisancePoints -= rows * 6 * 70;
+            AddSkullRows(players[1 - idx].m_Grid, rows);
+        }
+    }
+
+    stats1.Add(players[0].m_Latencies, players[0].m_TimedOut);
+    stats2.Add(players[1].m_Latencies, players[1].m_TimedOut);
+
+    if (players[0].m_Lost != players[1].m_Lost)
+        return players[0].m_Lost ? GameResult::Loss : GameResult::Win;
+
+    if (players[0].m_Lost || players[0].m_Score == players[1].m_Score)
+        return GameResult::Draw;
+
+    return players[0].m_Score > players[1].m_Score ? GameResult::Win : GameResult::Loss;
+}
+
+void PrintLatency(const char* name, LatencyStats& stats)
+{
+    vector<double>& latencies = stats.m_Latencies;
+    sort(latencies.begin(), latencies.end());
+
+    auto percentile = [&](size_t percent)
+    {
+        return latencies.empty() ? 0.0 : latencies[min(latencies.size() - 1, latencies.size() * percent / 100)];
+    };
+    size_t slow = latencies.end() - upper_bound(latencies.begin(), latencies.end(), TURN_LIMIT_MS);
+
+    cout << name << " turns " << latencies.size() << fixed << setprecision(2)
+        << "  p50 " << percentile(50) << " ms  p99 " << percentile(99) << " ms  max " << (latencies.empty() ? 0.0 : latencies.back())
+        << " ms  over " << setprecision(0) << TURN_LIMIT_MS << " ms " << slow << "  timeouts " << stats.m_Timeouts << endl;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 3)
+    {
+        cerr << "Usage: SmashTheCodeReferee \"bot1 [args]\" \"bot2 [args]\" [games] [threads]" << endl;
+        return 1;
+    }
+
+#if !defined(_WIN32)
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    string commands[2] = { argv[1], argv[2] };
+    size_t games = argc > 3 ? (size_t)atoi(argv[3]) : 100;
+    size_t threads = argc > 4 ? (size_t)atoi(argv[4]) : thread::hardware_concurrency();
+    threads = max<size_t>(1, threads);
+
+    LatencyStats stats[2];
+    atomic<size_t> next_game(0);
+    atomic<size_t> results[3];
+    for (auto& result : results)
+        result = 0;
+
+    auto worker = [&]()
+    {
+        for (size_t game = next_game++; game < games; game = next_game++)
+        {
+            uint64_t seed = 0x5EED5EED00000000ull + game / 2;
+
+            GameResult result;
+            if (game % 2 == 0)
+                result = PlayGame(commands[0], commands[1], seed, stats[0], stats[1]);
+            else
+                result = (GameResult)(2 - (int)PlayGame(commands[1], commands[0], seed, stats[1], stats[0]));
+
+            ++results[(size_t)result];
+        }
+    };
+
+    vector<thread> workers;
+    for (size_t i = 0; i < threads; ++i)
+        workers.emplace_back(worker);
+
+    for (auto& w : workers)
+        w.join();
+
+    size_t wins = results[(size_t)GameResult::Win];
+    size_t draws = results[(size_t)GameResult::Draw];
+    size_t losses = results[(size_t)GameResult::Loss];
+    size_t played = wins + draws + losses;
+
+    // Draw counts as half win, interval is normal approximation at 95%.
+    double rate = played ? (wins + 0.5 * draws) / played : 0.0;
+    double margin = played ? 1.96 * sqrt(rate * (1.0 - rate) / played) : 0.0;
+
+    cout << "games " << played << "  wins " << wins << "  draws " << draws << "  losses " << losses << endl;
+    cout << "bot1 win rate " << fixed << setprecision(1) << rate * 100.0 << "% +- " << margin * 100.0 << '%' << endl;
+    PrintLatency("bot1", stats[0]);
+    PrintLatency("bot2", stats[1]);
+
+    return 0;
+}